@@ -0,0 +1,191 @@
+/*
+ * Benchmark and cross-check of the packet validator kernels,
+ * built and run by `make bench`. Every kernel has to agree
+ * with the scalar one on random fields, status and sanitized
+ * bytes alike, before any of them is timed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "packet_validator.h"
+
+#define BENCH_FIELDS   (4096)  /* distinct inputs per corpus */
+#define BENCH_ROUNDS   (500)  /* passes over a corpus per timing */
+#define CHECK_FIELDS   (1000000)
+
+typedef field_status_t (*field_fn) (char *field);
+
+typedef struct {
+  const char  *name;
+  field_fn    ident;
+  field_fn    text;
+} kernel_t;
+
+static const char *fragments[] = {
+  /* well-formed */
+  "a", "Z", "7", " ", "_", "-", ".", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+  "\xef\xbf\xbf", "\xf4\x8f\xbf\xbf", "\xe0\xa0\x80", "\xf0\x90\x80\x80", "\xc2\x80",
+  /* malformed: overlong, surrogate, too large, stray, truncated, control */
+  "\xc0\xaf", "\xc1\xbf", "\xe0\x9f\xbf", "\xf0\x8f\xbf\xbf", "\xed\xa0\x80",
+  "\xf4\x90\x80\x80", "\x80", "\xbf", "\xff", "\xc3", "\xe2\x82", "\xf0\x9f",
+  "\x01", "\x1f", "\x7f", "\t"
+};
+#define FRAGMENTS_VALID (15)
+#define FRAGMENTS_ALL   (sizeof (fragments) / sizeof (fragments[0]))
+
+static double
+now_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+void
+random_field (char *field, size_t size, int invalid_per_mille)
+/*
+ * text built from fragments, terminated at a random length
+ * (or not at all) and followed by garbage
+ */
+{
+  size_t length = 0, target = rand () % (size + 8);
+  while (length < target)
+    {
+      const char *fragment = rand () % 1000 < invalid_per_mille
+          ? fragments[rand () % FRAGMENTS_ALL]
+          : fragments[rand () % FRAGMENTS_VALID];
+      size_t fragment_length = strlen (fragment);
+      if (length + fragment_length > size)
+        break;
+      memcpy (field + length, fragment, fragment_length);
+      length += fragment_length;
+    }
+  if (length < size)
+    field[length++] = 0;
+  for (; length < size; ++length)
+    field[length] = rand ();
+}
+
+bool
+cross_check (const kernel_t *kernel, const kernel_t *reference)
+{
+  char field[TEXT_FIELD_SIZE], expected[TEXT_FIELD_SIZE], actual[TEXT_FIELD_SIZE];
+  size_t mismatches = 0, seen[FIELD_STATUSES] = {0};
+
+  srand (1);
+  for (size_t round = 0; round < CHECK_FIELDS; ++round)
+    {
+      bool is_ident = round % 2;
+      size_t size = is_ident? IDENT_FIELD_SIZE: TEXT_FIELD_SIZE;
+      field_fn reference_fn = is_ident? reference->ident: reference->text;
+      field_fn kernel_fn = is_ident? kernel->ident: kernel->text;
+
+      random_field (field, size, (round / 2) % 3 == 0? 300: 5);
+      memcpy (expected, field, size);
+      memcpy (actual, field, size);
+      field_status_t want = reference_fn (expected), got = kernel_fn (actual);
+      ++seen[want];
+      if (want != got || (want == FIELD_VALID && memcmp (expected, actual, size)))
+        {
+          if (mismatches++ < 5)
+            printf ("  %s %s: expected '%s', got '%s'\n", kernel->name,
+                    is_ident? "ident": "text", field_status_names[want], field_status_names[got]);
+        }
+    }
+
+  printf ("%-6s agrees with scalar on %d fields: %s (", kernel->name, CHECK_FIELDS, mismatches? "NO": "yes");
+  for (size_t status = 0; status < FIELD_STATUSES; ++status)
+    printf ("%s%s %zu", status? ", ": "", field_status_names[status], seen[status]);
+  puts (")");
+  return !mismatches;
+}
+
+double
+time_kernel (field_fn fn, char (*corpus)[TEXT_FIELD_SIZE], size_t size)
+/*
+ * nanoseconds per field, copying included as the server
+ * validates packets it has just received
+ */
+{
+  char field[TEXT_FIELD_SIZE];
+  size_t valid = 0;
+  double start = now_ns ();
+  for (size_t round = 0; round < BENCH_ROUNDS; ++round)
+    for (size_t idx = 0; idx < BENCH_FIELDS; ++idx)
+      {
+        memcpy (field, corpus[idx], size);
+        valid += fn (field) == FIELD_VALID;
+      }
+  double elapsed = now_ns () - start;
+  if (valid == (size_t)-1)
+    puts ("");  /* keeps the calls from being optimized away */
+  return elapsed / (BENCH_ROUNDS * BENCH_FIELDS);
+}
+
+static field_status_t
+copy_only (char *field)
+{
+  return (field_status_t)(field[0] == 1);
+}
+
+void
+bench_corpus (
+    const char *name, const kernel_t *kernels, size_t nkernels,
+    bool is_ident, int invalid_per_mille, bool ascii_only
+    )
+{
+  static char corpus[BENCH_FIELDS][TEXT_FIELD_SIZE];
+  size_t size = is_ident? IDENT_FIELD_SIZE: TEXT_FIELD_SIZE;
+
+  srand (2);
+  for (size_t idx = 0; idx < BENCH_FIELDS; ++idx)
+    {
+      random_field (corpus[idx], size, invalid_per_mille);
+      if (ascii_only)
+        for (size_t byte = 0; byte < size; ++byte)
+          if (corpus[idx][byte] & 0x80)
+            corpus[idx][byte] = 'x';
+      if (!invalid_per_mille)
+        corpus[idx][size - 1] = 0;  /* always terminated */
+    }
+
+  printf ("%-22s copy %6.1fns", name, time_kernel (copy_only, corpus, size));
+  for (size_t kernel = 0; kernel < nkernels; ++kernel)
+    printf ("  %s %6.1fns", kernels[kernel].name,
+            time_kernel (is_ident? kernels[kernel].ident: kernels[kernel].text, corpus, size));
+  putchar ('\n');
+}
+
+int
+main (void)
+{
+  kernel_t kernels[3] = {
+    { "scalar", validate_ident_scalar, validate_text_scalar }
+  };
+  size_t nkernels = 1;
+  bool agree = true;
+
+#if defined (__x86_64__)
+  kernels[nkernels++] = (kernel_t){ "sse2", validate_ident_sse2, validate_text_sse2 };
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    kernels[nkernels++] = (kernel_t){ "avx2", validate_ident_sse2, validate_text_avx2 };
+  else
+    puts ("no AVX2 on this CPU, skipping its kernel");
+#endif
+
+  for (size_t kernel = 1; kernel < nkernels; ++kernel)
+    agree &= cross_check (&kernels[kernel], &kernels[0]);
+  if (!agree)
+    return EXIT_FAILURE;
+
+  puts ("\nper field, including the copy out of the receive buffer:");
+  bench_corpus ("ident (15 bytes)", kernels, nkernels, true, 0, true);
+  bench_corpus ("text, ASCII", kernels, nkernels, false, 0, true);
+  bench_corpus ("text, UTF-8", kernels, nkernels, false, 0, false);
+  bench_corpus ("text, mostly invalid", kernels, nkernels, false, 300, false);
+
+  return EXIT_SUCCESS;
+}
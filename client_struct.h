@@ -14,15 +14,23 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "pkt_struct.h"
+#include "coroutine.h"
 
 #define DEFAULT_EXPAND_SIZE (16)
 #define SERVER_IDENT        ("SERVER")
+#define CLIENT_INBOUND_SIZE (9 * sizeof (client_pkt_t))  /* READ_DEFICIT_MAX and a partial frame */
 
 typedef struct {
   sockfd_t  sockfd;
   struct    sockaddr_in address;
   char      ident[15];
   bool      is_identified;
+  bool      is_local;  /* accepted on the AF_UNIX listener */
+  bool      is_presence_subscriber;  /* gets PRESENCE_DELTA, not CLIENT_(DIS)CONNECT */
+  size_t    read_deficit;  /* bytes it may still read, see scheduler.h */
+  size_t    inbound_len;
+  char      inbound[CLIENT_INBOUND_SIZE];  /* received, not yet handled */
+  coro_t    handler;  /* see `connection_handler` */
 } client_t;
 
 typedef struct {
@@ -40,7 +48,7 @@ client_array_create (client_array_t *clients, size_t capacity)
 {
   clients->clients = (client_t *)calloc (capacity, sizeof (client_t));
 
-  if (clients == NULL)
+  if (clients->clients == NULL)
     return false;
 
   clients->free_indices = (bool *)calloc (capacity, sizeof (bool));  /* all initially false */
@@ -60,18 +68,25 @@ bool
 client_array_expand (client_array_t *clients, size_t size)
 /*
  * reallocate client array by `size` elements,
- * automatically called but can be manually invoked
+ * automatically called but can be manually invoked.
+ * pointers into the array don't survive it
  */
 {
   size_t new_size = clients->capacity + size;
-  bool failed = (realloc (clients->clients, sizeof (client_t) * new_size) == NULL)
-             || (realloc (clients->free_indices, sizeof (bool) * new_size) == NULL);
-  if (!failed)
-    {
-      memset (&clients->free_indices[clients->capacity], 0, sizeof (bool) * size);
-      clients->capacity += size;
-    }
-  return failed;
+  client_t *expanded = (client_t *)realloc (clients->clients, sizeof (client_t) * new_size);
+  if (expanded == NULL)
+    return false;
+  clients->clients = expanded;
+
+  bool *free_indices = (bool *)realloc (clients->free_indices, sizeof (bool) * new_size);
+  if (free_indices == NULL)
+    return false;  /* the larger `clients` is harmless */
+  clients->free_indices = free_indices;
+
+  memset (&clients->clients[clients->capacity], 0, sizeof (client_t) * size);
+  memset (&clients->free_indices[clients->capacity], 0, sizeof (bool) * size);
+  clients->capacity += size;
+  return true;
 }
 
 bool
@@ -95,7 +110,7 @@ client_array_add (client_array_t *clients, client_t *client)
     {
       if (!client_array_expand (clients, DEFAULT_EXPAND_SIZE))
         return false;
-      free_index = current_index + 1;  /* `current_index` pointed to end of array */
+      free_index = current_index;  /* `current_index` pointed to the old end of array */
     }
 
   memcpy (&clients->clients[free_index], client, sizeof (client_t));
@@ -110,7 +125,7 @@ client_array_get (client_array_t *clients, size_t idx)
  * get client by their index
  */
 {
-  if ((idx + 1) >= clients->capacity)
+  if (idx >= clients->capacity)
     return NULL;
   else if (!clients->free_indices[idx])
     return NULL;
@@ -123,7 +138,7 @@ client_array_remove (client_array_t *clients, size_t idx)
  * remove client by their index
  */
 {
-  if ((idx + 1) >= clients->capacity)
+  if (idx >= clients->capacity)
     return false;  /* out of bounds */
   else if (!clients->free_indices[idx])
     return false;  /* index empty or already removed */
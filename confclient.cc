@@ -12,21 +12,30 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/un.h>
 #include "pkt_struct.h"
+#include "shm_ring.h"
 
 #define ASSERT_NOT_REACHED assert (0);
+#define SHM_FULL_RETRY_US     (1000)
+#define SHM_FULL_TIMEOUT_US   (2000000)  /* before giving up on a full ring */
 
 
 /* structures allowing for asynchronous
  * stdin polling later */
 
-struct pollfd stdin_poll[1] = {{
-  .fd = 0,
-  .events = POLLIN
-  }};
+struct pollfd stdin_poll[2] = {
+  { .fd = 0, .events = POLLIN },
+  { .fd = -1, .events = POLLIN }  /* shared-memory doorbell, if any */
+  };
 char stdin_buffer[128];
 uint8_t stdin_idx = 0;
 
+/* set once the server grants a local client the
+ * shared-memory transport */
+shm_transport_t shm_transport;
+bool using_shm = false;
+
 sockfd_t
 connect_chatserver (const char *address, unsigned short port)
 /*
@@ -45,6 +54,51 @@ connect_chatserver (const char *address, unsigned short port)
   return sockfd;
 }
 
+sockfd_t
+connect_local_chatserver (const char *path)
+/*
+ * connects to the chatserver's AF_UNIX listener
+ */
+{
+  sockfd_t sockfd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+  struct sockaddr_un server_addr = {
+    .sun_family = AF_UNIX
+    };
+  strncpy (server_addr.sun_path, path, sizeof (server_addr.sun_path) - 1);
+
+  connect (sockfd, (struct sockaddr*)(&server_addr), sizeof (sockaddr_un));
+  return sockfd;
+}
+
+void
+transmit_packet (sockfd_t sockfd, client_pkt_t *packet)
+/*
+ * a full ring only means the server is behind, so wait
+ * for it to make room rather than drop the packet, and
+ * tell the user if it never does
+ */
+{
+  if (!using_shm)
+    {
+      send (sockfd, packet, sizeof (client_pkt_t), 0);
+      return;
+    }
+
+  for (unsigned waited = 0;
+       !shm_ring_push (&shm_transport.region->to_server, shm_transport.server_doorbell, packet);
+       waited += SHM_FULL_RETRY_US)
+    {
+      if (waited >= SHM_FULL_TIMEOUT_US
+          || __atomic_load_n (&shm_transport.region->closed, __ATOMIC_ACQUIRE))
+        {
+          puts ("the server isn't taking packets, your last message was not sent");
+          return;
+        }
+      usleep (SHM_FULL_RETRY_US);
+    }
+}
+
 void
 send_packet (sockfd_t sockfd, char *ident, uint8_t code, const char *message)
 /*
@@ -53,10 +107,10 @@ send_packet (sockfd_t sockfd, char *ident, uint8_t code, const char *message)
 {
   client_pkt_t packet = {0};
   packet.code = code;
-  memcpy (&packet.id, ident, 14);
+  strncpy (packet.id, ident, sizeof (packet.id) - 1);
   if (message != NULL)
-    memcpy (&packet.message, message, 127);  /* potential issue */
-  send (sockfd, &packet, sizeof (client_pkt_t), 0);
+    strncpy (packet.message, message, sizeof (packet.message) - 1);
+  transmit_packet (sockfd, &packet);
 }
 
 client_pkt_t
@@ -67,6 +121,41 @@ receive_packet (sockfd_t sockfd)
   return packet;
 }
 
+client_pkt_t
+receive_ack_packet (sockfd_t sockfd)
+/*
+ * like `receive_packet`, but picks up the shared-memory
+ * region a local server may attach to its CONNECT_ACK
+ */
+{
+  client_pkt_t packet = {0};
+  int fds[SHM_TRANSPORT_FDS];
+  char control[CMSG_SPACE (sizeof (fds))] = {0};
+  struct iovec iov = {
+    .iov_base = &packet,
+    .iov_len  = sizeof (client_pkt_t)
+    };
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  if (recvmsg (sockfd, &msg, 0) <= 0)
+    return packet;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+      && cmsg->cmsg_type == SCM_RIGHTS
+      && cmsg->cmsg_len == CMSG_LEN (sizeof (fds)))
+    {
+      memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+      using_shm = shm_transport_attach (&shm_transport, fds);
+      stdin_poll[1].fd = shm_transport.client_doorbell;
+    }
+  return packet;
+}
+
 int
 socket_setnonblocking (sockfd_t sockfd)
 /*
@@ -86,6 +175,22 @@ print_server_packet (client_pkt_t packet)
   printf ("|| %s: %s\n", packet.id, packet.message);
 }
 
+void
+print_user_list (client_pkt_t packet)
+/*
+ * one USER_LIST page, the last one lacks PRESENCE_PAGE_MORE
+ */
+{
+  presence_page_t page;
+  char ident[15] = {0};
+  memcpy (&page, packet.message, sizeof (presence_page_t));
+  for (uint8_t idx = 0; idx < page.count && idx < PRESENCE_PAGE_IDENTS; ++idx)
+    {
+      memcpy (ident, page.idents[idx], 14);
+      printf ("|| online: %s\n", ident);
+    }
+}
+
 bool
 process_server_packet (client_pkt_t packet)
 /*
@@ -107,6 +212,9 @@ process_server_packet (client_pkt_t packet)
         puts ("your private message was unsuccessful, as the user you're trying "
               "to message doesn't exist");
         return true;
+      case (PACKET_REJECTED):
+        printf ("the server refused your last message: %s\n", packet.message);
+        return true;
       case (PRIVATE_MESSAGE):
         printf ("PM from %s: %s\n", packet.id, packet.message);
         return true;
@@ -118,6 +226,15 @@ process_server_packet (client_pkt_t packet)
       case (MESSAGE_TRANS):
         printf ("%s: %s\n", packet.id, packet.message);
         return true;
+      case (USER_LIST):
+        print_user_list (packet);
+        return true;
+      case (SERVER_STATS):
+        print_server_packet (packet);
+        return true;
+      case (PRESENCE_DELTA):
+      case (PRESENCE_RESYNC):
+        return true;  /* never subscribed to, nothing to do */
       default:
         printf ("got code=%d, message=%s\n", packet.code, packet.message);
         ASSERT_NOT_REACHED;
@@ -140,12 +257,26 @@ bool
 handle_command (char *ident, sockfd_t sockfd)
 /*
  * very naive implementation of command handling,
- * only supporting /pm
+ * only supporting /pm, /users and /stats
  */
 {
-  char* command = strtok (stdin_buffer, " ");
+  char* command = strtok (stdin_buffer, " \n");
 
-  if (!strcmp (command, "/pm"))
+  if (!strcmp (command, "/users"))
+    {
+      client_pkt_t packet = {0};
+      packet.code = LIST_USERS;  /* empty cursor and no limit, the whole list */
+      transmit_packet (sockfd, &packet);
+      while (strtok (NULL, " ") != NULL);
+    }
+  else if (!strcmp (command, "/stats"))
+    {
+      client_pkt_t packet = {0};
+      packet.code = QUERY_STATS;
+      transmit_packet (sockfd, &packet);
+      while (strtok (NULL, " ") != NULL);
+    }
+  else if (!strcmp (command, "/pm"))
     {
       char *recipient, *message;
       recipient = strtok (NULL, " ");
@@ -154,14 +285,16 @@ handle_command (char *ident, sockfd_t sockfd)
           puts ("misformatted pm command, must have recipient");
           return true;
         }
-      message = &stdin_buffer[strlen ("/pm") + strlen (recipient) + 2];
+      message = &stdin_buffer[strlen ("/pm") + strlen (recipient) + 1];
+      if (*message == 0 && message < &stdin_buffer[sizeof (stdin_buffer) - 1])
+        ++message;  /* past the separator `strtok` overwrote */
       
       client_pkt_t packet = {0};
       packet.code = PRIVATE_MESSAGE;
-      memcpy (&packet.id, recipient, 14);
-      memcpy (&packet.message, message, 127);
+      strncpy (packet.id, recipient, sizeof (packet.id) - 1);
+      strncpy (packet.message, message, sizeof (packet.message) - 1);
 
-      send (sockfd, &packet, sizeof (client_pkt_t), 0);
+      transmit_packet (sockfd, &packet);
 
       while (strtok (NULL, " ") != NULL);  /* clear `strtok` internal state */
     }
@@ -177,9 +310,9 @@ handle_stdin_command (char *ident, sockfd_t sockfd)
  * emoticon handling
  */
 {
+  stdin_buffer[stdin_idx] = 0;  /* the server refuses control characters */
   if (stdin_buffer[0] == '/')
     return handle_command (ident, sockfd);
-  stdin_buffer[stdin_idx] = 0;
   send_packet (sockfd, ident, MESSAGE_TRANS, stdin_buffer);
   clear_stdin ();
   return true;
@@ -190,14 +323,29 @@ poll_for_stdin (char *ident, sockfd_t sockfd)
 /*
  * wait every 500ms for an input on stdin,
  * read, store and then go back to the
- * event loop
+ * event loop. on the shared-memory transport
+ * the doorbell cuts the wait short
  */
 {
-  if (poll (stdin_poll, 1, 500) <= 0)
+  int nready;
+  if (using_shm && !shm_ring_sleep (&shm_transport.region->to_client))
+    return false;  /* packets already waiting */
+  nready = poll (stdin_poll, using_shm? 2: 1, 500);
+  if (using_shm)
+    shm_ring_wake (&shm_transport.region->to_client, shm_transport.client_doorbell);
+  if (nready <= 0 || !(stdin_poll[0].revents & POLLIN))
     return false;
   read (0, &stdin_buffer[stdin_idx], 1);
   if (stdin_buffer[stdin_idx] == '\n')
     return handle_stdin_command (ident, sockfd);
+  else if (stdin_buffer[stdin_idx] == '\t')
+    stdin_buffer[stdin_idx] = ' ';
+  else if ((unsigned char)stdin_buffer[stdin_idx] < 0x20 || stdin_buffer[stdin_idx] == 0x7f)
+    /* the server refuses control characters, drop them */
+    {
+      stdin_buffer[stdin_idx] = 0;
+      return true;
+    }
   ++stdin_idx;
   if (stdin_idx >= 127)
     stdin_idx = 0;  /* start overwriting from start */
@@ -205,16 +353,18 @@ poll_for_stdin (char *ident, sockfd_t sockfd)
 }
 
 void
-run_chatloop_indefinitely (char *ident, sockfd_t sockfd)
+run_chatloop_indefinitely (char *ident, sockfd_t sockfd, bool is_local)
 {
   client_pkt_t last_message;
   
   printf ("identifying... ");
-  send_packet (sockfd, ident, CLIENT_IDENT, NULL);
-  last_message = receive_packet (sockfd);
+  send_packet (sockfd, ident, CLIENT_IDENT, is_local? SHM_TRANSPORT_REQUEST: NULL);
+  last_message = receive_ack_packet (sockfd);
 
   if (last_message.code != CONNECT_ACK)
     goto on_error;
+  else if (using_shm)
+    printf ("using shared-memory transport... ");
 
   printf ("done.\nsetting server socket to non-blocking... ");
   socket_setnonblocking (sockfd);
@@ -224,6 +374,14 @@ run_chatloop_indefinitely (char *ident, sockfd_t sockfd)
 
   for (;;)
     {
+      if (using_shm)
+        {
+          while (shm_ring_pop (&shm_transport.region->to_client, &last_message))
+            if (!process_server_packet (last_message))
+              goto on_error;
+          if (__atomic_load_n (&shm_transport.region->closed, __ATOMIC_ACQUIRE))
+            goto on_error;
+        }
       recv_status = recv (sockfd, &last_message, sizeof (client_pkt_t), 0);
       if (!recv_status)
         goto on_error;
@@ -237,6 +395,8 @@ run_chatloop_indefinitely (char *ident, sockfd_t sockfd)
 
 on_error:
   printf ("disconnecting... ");
+  if (using_shm)
+    shm_transport_free (&shm_transport);
   close (sockfd);
   printf ("done.\n");
   return;
@@ -245,21 +405,25 @@ on_error:
 int
 main (int argc, char ** argv)
 {
-  if (argc != 4)
+  if (argc != 3 && argc != 4)
     {
       printf ("%s <name {14 characters}> <server-ip> <server-port>\n", argv[0]);
+      printf ("%s <name {14 characters}> <server-socket-path>\n", argv[0]);
       return EXIT_FAILURE;
     }
 
   char ident[15] = {0};
-  memcpy (ident, argv[1], 14);
+  strncpy (ident, argv[1], 14);
 
-  const char *address = argv[2];
-  unsigned short port = atoi (argv[3]);
+  bool is_local = (argc == 3);
+  sockfd_t server_sockfd;
 
-  sockfd_t server_sockfd = connect_chatserver (address, port);
+  if (is_local)
+    server_sockfd = connect_local_chatserver (argv[2]);
+  else
+    server_sockfd = connect_chatserver (argv[2], atoi (argv[3]));
 
-  run_chatloop_indefinitely (ident, server_sockfd);
+  run_chatloop_indefinitely (ident, server_sockfd, is_local);
 
   return EXIT_SUCCESS;
 }
@@ -10,13 +10,47 @@
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include "pkt_struct.h"
 #include "client_struct.h"
+#include "fanout_pool.h"
+#include "shm_ring.h"
+#include "presence.h"
+#include "scheduler.h"
+#include "packet_validator.h"
 
 #define ASSERT_NOT_REACHED assert(0);
+#define SHM_LIVENESS_INTERVAL (4096)  /* loop iterations between socket probes */
+#define PRESENCE_FLUSH_MS     (20)  /* joins/leaves are announced in batches this often */
+#define PRESENCE_STORM_SIZE   (16)  /* above this many per batch, legacy clients get a summary */
+#define EVICT_LINGER_MS       (1000)  /* how long an evicted client gets to take its error */
+#define EVICT_LINGER_MAX      (64)
+
+static fanout_pool_t fanout_pool;  /* writers for large broadcasts */
+
+static shm_transport_t **local_transports;  /* indexed by sockfd */
+static size_t local_transports_len;
+
+static presence_index_t presence;
+
+static outbox_t **outboxes;  /* indexed by sockfd, allocated on first backlog */
+static size_t outboxes_len;
+static latency_stats_t latency_stats;
+static memory_governor_t memory_governor;
+
+typedef struct {
+  sockfd_t  sockfd;
+  uint64_t  deadline_ms;
+} lingering_t;
+
+static lingering_t lingering[EVICT_LINGER_MAX];  /* evicted, closed once their error is out */
+static size_t lingering_len;
+static packet_validator_t packet_validator;  /* kernel picked at startup */
 
 void
 printerr (const char *str)
@@ -64,6 +98,53 @@ create_server_socket (
   return sockfd;
 }
 
+sockfd_t
+create_local_server_socket (const char *path)
+/*
+ * creates AF_UNIX stream socket bound to `path`, for
+ * clients on the same host that would otherwise pay
+ * for the loopback TCP stack
+ */
+{
+  sockfd_t sockfd;
+  struct stat existing;
+  struct sockaddr_un binding_address = {
+      .sun_family = AF_UNIX
+    };
+
+  if (strlen (path) >= sizeof (binding_address.sun_path))
+    {
+      puts ("error: local socket path is too long");
+      return -1;
+    }
+  memcpy (binding_address.sun_path, path, strlen (path));
+
+  if (!lstat (path, &existing))
+    {
+      if (!S_ISSOCK (existing.st_mode))
+        {
+          printf ("error: %s exists and is not a socket\n", path);
+          return -1;
+        }
+      unlink (path);  /* stale from a previous run */
+    }
+
+  if ( (sockfd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+    {
+      printerr ("failed to create local socket");
+      return -1;
+    }
+
+  if (bind (sockfd, (struct sockaddr*)(&binding_address), sizeof (struct sockaddr_un)) < 0)
+    {
+      printerr ("failed to bind local socket");
+      close (sockfd);
+      return -1;
+    }
+
+  return sockfd;
+}
+
 bool
 start_listening (sockfd_t sockfd, int backlog)
 {
@@ -75,38 +156,236 @@ start_listening (sockfd_t sockfd, int backlog)
   return true;
 }
 
+shm_transport_t*
+local_transport (sockfd_t sockfd)
+{
+  if (sockfd < 0 || (size_t)sockfd >= local_transports_len)
+    return NULL;
+  return local_transports[sockfd];
+}
+
+outbox_t*
+connection_outbox (sockfd_t sockfd, bool create)
+{
+  outbox_t *outbox;
+  if (sockfd < 0 || (size_t)sockfd >= outboxes_len)
+    return NULL;
+  /* atomic as `evict_worst_consumer` peeks at other writers' sockets */
+  else if ( (outbox = __atomic_load_n (&outboxes[sockfd], __ATOMIC_ACQUIRE)) == NULL && create)
+    {
+      outbox = outbox_create (&memory_governor);
+      __atomic_store_n (&outboxes[sockfd], outbox, __ATOMIC_RELEASE);
+    }
+  return outbox;
+}
+
+ssize_t
+transport_try_write (sockfd_t sockfd, const char *data, size_t size)
+/*
+ * write as much of a frame as the connection takes right
+ * now, -1 with EWOULDBLOCK when nothing fits, -1 with any
+ * other errno when the peer is gone
+ */
+{
+  shm_transport_t *shm = local_transport (sockfd);
+  if (shm == NULL)
+    return send (sockfd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+  else if (shm_ring_push (&shm->region->to_client, shm->client_doorbell, (const client_pkt_t *)data))
+    return size;  /* rings only ever carry whole frames */
+  errno = EWOULDBLOCK;
+  return -1;
+}
+
 void
-broadcast_message (
-    client_array_t *clients, client_t *from,
-    client_pkt_t *packet
+transport_flush (sockfd_t sockfd)
+/*
+ * write out as much of the socket's outbox as it takes,
+ * most urgent class first
+ */
+{
+  outbox_t *outbox = connection_outbox (sockfd, false);
+  outbox_frame_t *frame;
+  ssize_t nsent;
+
+  if (outbox == NULL)
+    return;
+
+  while ( (frame = outbox_peek (outbox)) != NULL)
+    {
+      nsent = transport_try_write (
+          sockfd, (const char *)&frame->packet + outbox->inflight_offset,
+          sizeof (client_pkt_t) - outbox->inflight_offset);
+      if (nsent < 0 && errno == EWOULDBLOCK)
+        return;
+      else if (nsent < 0)
+        /* peer is gone, the polling loop will notice */
+        {
+          outbox_clear (outbox);
+          return;
+        }
+      outbox->inflight_offset += nsent;
+      if (outbox->inflight_offset < sizeof (client_pkt_t))
+        return;
+      latency_stats_record (&latency_stats, packet_priority (frame->packet.code), frame->stamp);
+      outbox_pop (outbox);
+    }
+}
+
+void
+transport_write (sockfd_t sockfd, const client_pkt_t *packet, uint64_t stamp)
+/*
+ * the single point where packets leave the server. written
+ * straight away when nothing is backed up, otherwise queued
+ * in the outbox by priority
+ */
+{
+  outbox_t *outbox = connection_outbox (sockfd, false);
+  ssize_t nsent = 0;
+
+  if (outbox == NULL || !outbox->queued)
+    {
+      nsent = transport_try_write (sockfd, (const char *)packet, sizeof (client_pkt_t));
+      if (nsent == sizeof (client_pkt_t))
+        {
+          latency_stats_record (&latency_stats, packet_priority (packet->code), stamp);
+          return;
+        }
+      else if (nsent < 0 && errno != EWOULDBLOCK)
+        return;  /* peer is gone */
+      else if (nsent < 0)
+        nsent = 0;
+    }
+
+  if ( (outbox = connection_outbox (sockfd, true)) == NULL)
+    return;  /* out of memory, dropped like the socket would have */
+  else if (nsent)
+    /* partly written, the rest has to go out before anything else */
+    outbox_push_inflight (outbox, packet, stamp, nsent);
+  else if (!outbox_push (outbox, packet, stamp))
+    return;  /* refused by the memory governor */
+  transport_flush (sockfd);
+}
+
+void
+transport_close (sockfd_t sockfd)
+{
+  shm_transport_t *shm = local_transport (sockfd);
+  outbox_t *outbox = connection_outbox (sockfd, false);
+  if (shm != NULL)
+    {
+      shm_transport_free (shm);
+      free (shm);
+      local_transports[sockfd] = NULL;
+    }
+  if (outbox != NULL)
+    {
+      outbox_clear (outbox);
+      __atomic_store_n (&outboxes[sockfd], NULL, __ATOMIC_RELEASE);
+      free (outbox);
+    }
+  close (sockfd);
+}
+
+bool
+grant_local_transport (client_t *client, client_pkt_t *ack)
+/*
+ * switch a local client over to the shared-memory rings,
+ * `ack` is delivered with the region attached. refused
+ * while writers still owe the socket older packets, which
+ * would otherwise land after the ack on the wrong transport
+ */
+{
+  if (!client->is_local || local_transport (client->sockfd) != NULL)
+    return false;
+  else if ((size_t)client->sockfd >= local_transports_len)
+    return false;
+  else if (!fanout_pool_idle (&fanout_pool, client->sockfd))
+    return false;
+  else if (connection_outbox (client->sockfd, false) != NULL
+           && connection_outbox (client->sockfd, false)->queued)
+    return false;
+
+  shm_transport_t *shm = (shm_transport_t *)malloc (sizeof (shm_transport_t));
+  if (shm == NULL)
+    return false;
+  else if (!shm_transport_create (shm))
+    {
+      free (shm);
+      return false;
+    }
+  else if (!shm_transport_grant (shm, client->sockfd, ack))
+    {
+      shm_transport_free (shm);
+      free (shm);
+      return false;
+    }
+
+  local_transports[client->sockfd] = shm;
+  return true;
+}
+
+void
+broadcast_filtered (
+    client_array_t *clients, fanout_filter_fn accept,
+    const void *arg, client_pkt_t *packet
     )
 /*
- * broadcast a packet to everyone except
- * the `from` client
+ * broadcast a packet to every client `accept` agrees
+ * with, large audiences are handed to the fan-out pool
+ * instead of being sent inline
  */
 {
+  if (fanout_pool_broadcast (&fanout_pool, clients, accept, arg, packet))
+    return;
+
   for (size_t free_idx = 0; free_idx < clients->capacity; ++free_idx)
     {
       if (!clients->free_indices[free_idx])
         continue;
-      else if (from == &clients->clients[free_idx])
+      else if (!accept (&clients->clients[free_idx], arg))
         continue;
-      send (clients->clients[free_idx].sockfd, packet, sizeof (client_pkt_t), 0);
+      fanout_pool_send (&fanout_pool, clients->clients[free_idx].sockfd, packet);
     }
 }
 
+bool
+is_not_sender (const client_t *client, const void *from)
+{
+  return client != from;
+}
+
+void
+broadcast_message (
+    client_array_t *clients, client_t *from,
+    client_pkt_t *packet
+    )
+/*
+ * broadcast a packet to everyone except
+ * the `from` client
+ */
+{
+  broadcast_filtered (clients, is_not_sender, from, packet);
+}
+
+void
+build_server_packet (client_pkt_t *packet, uint8_t code, const char *message)
+{
+  memset (packet, 0, sizeof (client_pkt_t));
+  memcpy (&packet->id, SERVER_IDENT, strlen (SERVER_IDENT));
+  if (message != NULL)
+    strncpy (packet->message, message, sizeof (packet->message) - 1);
+  packet->code = code;
+}
+
 void
 send_packet (sockfd_t sockfd, uint8_t code, const char *message)
 /*
  * send a server-level packet to a client
  */
 {
-  client_pkt_t packet = {0};
-  memcpy (&packet.id, SERVER_IDENT, strlen (SERVER_IDENT));
-  if (message != NULL)
-    memcpy (&packet.message, message, 127);
-  packet.code = code;
-  send (sockfd, &packet, sizeof (client_pkt_t), 0); 
+  client_pkt_t packet;
+  build_server_packet (&packet, code, message);
+  fanout_pool_send (&fanout_pool, sockfd, &packet);
 }
 
 void
@@ -116,13 +395,31 @@ send_private_message (client_t *from, client_t *to, const char *message)
   memcpy (&packet.id, from->ident, 14);
   memcpy (&packet.message, message, 127);
   packet.code = PRIVATE_MESSAGE;
-  send (to->sockfd, &packet, sizeof (client_pkt_t), 0);
+  fanout_pool_send (&fanout_pool, to->sockfd, &packet);
+}
+
+bool
+is_presence_subscriber (const client_t *client, const void *unused)
+{
+  return client->is_presence_subscriber;
+}
+
+bool
+is_legacy_presence_recipient (const client_t *client, const void *ident)
+/*
+ * clients not subscribed to deltas, except the user
+ * being announced, who already knows it joined
+ */
+{
+  return !client->is_presence_subscriber
+      && (ident == NULL || strncmp (client->ident, (const char *)ident, 14));
 }
 
 void
-send_connection_state (client_array_t *clients, client_t *client, bool connected)
+send_connection_state (client_array_t *clients, const char *ident, bool connected)
 /*
  * helper method to announce connected/disconnected clients
+ * to everyone not subscribed to presence deltas
  */
 {
   client_pkt_t packet = {0};
@@ -138,62 +435,320 @@ send_connection_state (client_array_t *clients, client_t *client, bool connected
       memcpy (packet.message, "User disconnected", strlen ("User disconnected"));
     }
 
-  if (client->ident != NULL)
-    memcpy (packet.id, client->ident, 14);
-  else
-    memcpy (packet.id, "(unknown)", strlen ("(unknown)"));
+  memcpy (packet.id, ident, 14);
+  broadcast_filtered (clients, is_legacy_presence_recipient, connected? ident: NULL, &packet);
+}
+
+void
+send_presence_summary (client_array_t *clients, size_t joined, size_t left)
+/*
+ * one packet per kind in place of a storm of announcements
+ */
+{
+  client_pkt_t packet;
+
+  if (joined)
+    {
+      build_server_packet (&packet, CLIENT_CONNECT, NULL);
+      snprintf (packet.message, sizeof (packet.message), "%zu users connected", joined);
+      broadcast_filtered (clients, is_legacy_presence_recipient, NULL, &packet);
+    }
+  if (left)
+    {
+      build_server_packet (&packet, CLIENT_DISCONNECT, NULL);
+      snprintf (packet.message, sizeof (packet.message), "%zu users disconnected", left);
+      broadcast_filtered (clients, is_legacy_presence_recipient, NULL, &packet);
+    }
+}
+
+void
+send_presence_deltas (
+    client_array_t *clients, sockfd_t sockfd,
+    uint32_t since, uint32_t until
+    )
+/*
+ * pack changes (since, until] into PRESENCE_DELTA pages, sent
+ * to `sockfd`, or to every subscriber if `sockfd` is -1
+ */
+{
+  client_pkt_t packet;
+  presence_page_t *page = (presence_page_t *)packet.message;
+
+  build_server_packet (&packet, PRESENCE_DELTA, NULL);
+  for (uint32_t version = since + 1; version <= until; ++version)
+    {
+      presence_change_t *change = presence_index_change (&presence, version);
+      memcpy (page->idents[page->count], change->ident, 15);
+      if (change->joined)
+        page->flags |= 1 << page->count;
+      page->version = version;
+
+      if (++page->count < PRESENCE_PAGE_IDENTS && version < until)
+        continue;
+      if (sockfd > -1)
+        fanout_pool_send (&fanout_pool, sockfd, &packet);
+      else
+        broadcast_filtered (clients, is_presence_subscriber, NULL, &packet);
+      build_server_packet (&packet, PRESENCE_DELTA, NULL);
+    }
+}
+
+void
+send_presence_resync (sockfd_t sockfd, uint32_t version)
+{
+  client_pkt_t packet;
+  build_server_packet (&packet, PRESENCE_RESYNC, NULL);
+  ((presence_page_t *)packet.message)->version = version;
+  fanout_pool_send (&fanout_pool, sockfd, &packet);
+}
+
+bool
+build_user_list_page (client_pkt_t *packet, char *cursor, size_t *remaining)
+/*
+ * the page of the sorted presence index following
+ * `cursor`, which is moved past it. true while there
+ * are more pages left to build
+ */
+{
+  presence_page_t *page = (presence_page_t *)packet->message;
+  size_t position = presence_index_upper_bound (&presence, cursor);
+
+  build_server_packet (packet, USER_LIST, NULL);
+  page->version = presence.version;
+  for (; position < presence.size && *remaining && page->count < PRESENCE_PAGE_IDENTS; ++position)
+    {
+      memcpy (page->idents[page->count++], presence.idents[position], 15);
+      --*remaining;
+    }
+  if (position < presence.size)
+    page->flags = PRESENCE_PAGE_MORE;
+  if (page->count)
+    memcpy (cursor, page->idents[page->count - 1], 15);
+
+  return position < presence.size && *remaining;
+}
+
+void
+flush_presence (client_array_t *clients)
+/*
+ * announce the joins/leaves gathered since the last flush,
+ * as delta pages for subscribers and as CLIENT_CONNECT /
+ * CLIENT_DISCONNECT for everyone else, summarized if a
+ * login storm piled up too many of them
+ */
+{
+  static uint64_t last_flush_ms;
+  uint32_t since = presence.flushed_version, until = presence.version;
+  uint64_t now;
+
+  if (since == until)
+    return;
+  else if ( (now = monotonic_ns () / 1000000) - last_flush_ms < PRESENCE_FLUSH_MS)
+    return;
+  last_flush_ms = now;
+  presence.flushed_version = until;
+
+  if (!presence_index_has_since (&presence, since))
+    /* more changes than the log holds within one flush */
+    {
+      for (size_t free_idx = 0; free_idx < clients->capacity; ++free_idx)
+        if (clients->free_indices[free_idx]
+            && clients->clients[free_idx].is_presence_subscriber)
+          send_presence_resync (clients->clients[free_idx].sockfd, until);
+
+      client_pkt_t packet;
+      build_server_packet (&packet, CLIENT_CONNECT, NULL);
+      snprintf (packet.message, sizeof (packet.message), "%zu users online", presence.size);
+      broadcast_filtered (clients, is_legacy_presence_recipient, NULL, &packet);
+      return;
+    }
+
+  send_presence_deltas (clients, -1, since, until);
+
+  if (until - since > PRESENCE_STORM_SIZE)
+    {
+      size_t joined = 0;
+      for (uint32_t version = since + 1; version <= until; ++version)
+        joined += presence_index_change (&presence, version)->joined;
+      send_presence_summary (clients, joined, until - since - joined);
+      return;
+    }
+
+  for (uint32_t version = since + 1; version <= until; ++version)
+    {
+      presence_change_t *change = presence_index_change (&presence, version);
+      send_connection_state (clients, change->ident, change->joined);
+    }
+}
+
+void
+subscribe_presence (client_array_t *clients, client_t *client, uint32_t version)
+/*
+ * catch a new subscriber up to the last flush, after
+ * which it receives the same batches as everyone else
+ */
+{
+  uint32_t flushed = presence.flushed_version;
 
-  broadcast_message (clients, connected? client: NULL, &packet);
+  if (version <= flushed && presence_index_has_since (&presence, version))
+    send_presence_deltas (clients, client->sockfd, version, flushed);
+  else
+    send_presence_resync (client->sockfd, flushed);
+  client->is_presence_subscriber = true;
 }
 
 void
-handle_client_packet (client_array_t *clients, client_t *sender, client_pkt_t packet)
+send_server_stats (sockfd_t sockfd)
+/*
+ * one SERVER_STATS line per priority class, then memory
+ * usage and validation
+ */
+{
+  client_pkt_t packet;
+  for (size_t priority = 0; priority < PRIORITY_CLASSES; ++priority)
+    {
+      build_server_packet (&packet, SERVER_STATS, NULL);
+      latency_stats_format (&latency_stats, (priority_t)priority,
+                            packet.message, sizeof (packet.message));
+      fanout_pool_send (&fanout_pool, sockfd, &packet);
+    }
+
+  build_server_packet (&packet, SERVER_STATS, NULL);
+  memory_governor_format (&memory_governor, packet.message, sizeof (packet.message));
+  fanout_pool_send (&fanout_pool, sockfd, &packet);
+
+  build_server_packet (&packet, SERVER_STATS, NULL);
+  snprintf (packet.message, sizeof (packet.message), "validation: kernel=%s rejected=%zu",
+            packet_validator.name, packet_validator.rejected);
+  fanout_pool_send (&fanout_pool, sockfd, &packet);
+}
+
+field_status_t
+validate_client_packet (client_pkt_t *packet)
+/*
+ * check the text fields `packet->code` makes use of, and
+ * zero whatever follows their terminators
+ */
+{
+  field_status_t status = FIELD_VALID;
+  switch (packet->code)
+    {
+      case (CLIENT_IDENT):
+      case (PRIVATE_MESSAGE):
+        if ( (status = packet_validator.ident (packet->id)) == FIELD_VALID)
+          status = packet_validator.text (packet->message);
+        break;
+      case (MESSAGE_TRANS):  /* `id` is overwritten with the sender's */
+        status = packet_validator.text (packet->message);
+        break;
+      case (LIST_USERS):  /* `message` is binary */
+        status = packet_validator.ident (packet->id);
+        break;
+    }
+  if (status != FIELD_VALID)
+    ++packet_validator.rejected;
+  return status;
+}
+
+bool
+identify_client (client_array_t *clients, client_t *sender, client_pkt_t *packet)
+/*
+ * validate a CLIENT_IDENT and acknowledge it, false if
+ * the sender was turned away and dropped
+ */
+{
+  char *ident = packet->id;
+  sockfd_t sockfd;
+
+  if (!strlen (ident))
+    {
+      printf ("Socket #%d tried to identify with empty name\n", sender->sockfd);
+      send_packet (sender->sockfd, INVALID_IDENT, "Empty identity disallowed");
+      sockfd = sender->sockfd;
+      client_array_remove_byref (clients, sender);
+      fanout_pool_close (&fanout_pool, sockfd);
+      return false;
+    }
+  else if (client_array_contains_ident (clients, NULL, ident))
+    {
+      printf ("Socket #%d tried to identify with an existing name: %s\n", sender->sockfd, ident);
+      send_packet (sender->sockfd, INVALID_IDENT, "Identity already exists");
+      sockfd = sender->sockfd;
+      client_array_remove_byref (clients, sender);
+      fanout_pool_close (&fanout_pool, sockfd);
+      return false;
+    }
+  printf ("User '%s' identified\n", ident);
+  if (sender->is_local && !strncmp (packet->message, SHM_TRANSPORT_REQUEST, sizeof (packet->message)))
+    {
+      client_pkt_t ack;
+      build_server_packet (&ack, CONNECT_ACK, "Welcome to the chatserver");
+      if (grant_local_transport (sender, &ack))
+        printf ("User '%s' switched to shared-memory transport\n", ident);
+      else
+        fanout_pool_send (&fanout_pool, sender->sockfd, &ack);
+    }
+  else
+    send_packet (sender->sockfd, CONNECT_ACK, "Welcome to the chatserver");
+  memcpy (&sender->ident, ident, 14);
+  sender->is_identified = true;
+  return true;
+}
+
+bool
+handle_client_packet (
+    client_array_t *clients, client_t *sender,
+    client_pkt_t packet, bool *list_users
+    )
 /*
- * large protocol-specified switch-case handling client events
+ * large protocol-specified switch-case handling client events,
+ * returns false if the sender was dropped. an accepted
+ * LIST_USERS sets `list_users`, the caller pages it out
  */
 {
-  char *ident;
+  sockfd_t sockfd;
+  presence_request_t *request;
+  field_status_t status;
+  char reason[128] = {0};
+
+  *list_users = false;
+
+  if ( (status = validate_client_packet (&packet)) != FIELD_VALID)
+    {
+      printf ("Socket #%d sent a malformed packet: %s\n", sender->sockfd, field_status_names[status]);
+      snprintf (reason, sizeof (reason), "Malformed packet: %s", field_status_names[status]);
+      if (packet.code == CLIENT_IDENT && !sender->is_identified)
+        {
+          send_packet (sender->sockfd, INVALID_IDENT, reason);
+          sockfd = sender->sockfd;
+          client_array_remove_byref (clients, sender);
+          fanout_pool_close (&fanout_pool, sockfd);
+          return false;
+        }
+      send_packet (sender->sockfd, PACKET_REJECTED, reason);
+      return true;
+    }
+
   switch (packet.code)
     {
       case (CLIENT_IDENT):
-        ident = packet.id;
         if (sender->is_identified)
           {
             puts ("identified client tried to reidentify, ignoring");
-            return;
-          }
-        else if (!strlen (ident))
-          {
-            printf ("Socket #%d tried to identify with empty name\n", sender->sockfd);
-            send_packet (sender->sockfd, INVALID_IDENT, "Empty identity disallowed");
-            client_array_remove_byref (clients, sender);
-            close (sender->sockfd);
-            return;
+            return true;
           }
-        else if (client_array_contains_ident (clients, NULL, ident))
-          {
-            printf ("Socket #%d tried to identify with an existing name: %s\n", sender->sockfd, ident);
-            send_packet (sender->sockfd, INVALID_IDENT, "Identity already exists");
-            client_array_remove_byref (clients, sender);
-            close (sender->sockfd);
-            return;
-          }
-        printf ("User '%s' identified\n", ident);
-        send_packet (sender->sockfd, CONNECT_ACK, "Welcome to the chatserver");
-        memcpy (&sender->ident, ident, 14);
-        send_connection_state (clients, sender, true);
-        sender->is_identified = true;
-        break;
+        return identify_client (clients, sender, &packet);
       case (MESSAGE_TRANS):
         if (!sender->is_identified)
           {
             printf ("User '%s' tried to chat without being identified\n", sender->ident);
             send_packet (sender->sockfd, GENERAL_ERROR, "Must be identified to chat");
+            sockfd = sender->sockfd;
             client_array_remove_byref (clients, sender);
-            close (sender->sockfd);
-            return;
+            fanout_pool_close (&fanout_pool, sockfd);
+            return false;
           }
-        memcpy (packet.id, sender->ident, 14);
+        memcpy (packet.id, sender->ident, sizeof (packet.id));  /* NUL-padded, unlike what the client sent */
         broadcast_message (clients, sender, &packet);
         break;
       case (PRIVATE_MESSAGE):
@@ -202,26 +757,370 @@ handle_client_packet (client_array_t *clients, client_t *sender, client_pkt_t pa
           {
             printf ("User '%s' tried to PM '%s' without being identified\n", sender->ident, packet.id);
             send_packet (sender->sockfd, GENERAL_ERROR, "Must be identified to PM");
+            sockfd = sender->sockfd;
             client_array_remove_byref (clients, sender);
-            close (sender->sockfd);
-            return;
+            fanout_pool_close (&fanout_pool, sockfd);
+            return false;
           }
         else if (!client_array_contains_ident (clients, &receiver, packet.id))
           {
             printf ("User '%s' tried to PM non-existent user: '%s'\n", sender->ident, packet.id);
             send_packet (sender->sockfd, INVALID_PM_IDENT, "User doesn't exist");
-            return;
+            return true;
           }
         send_private_message (sender, receiver, packet.message);
         break;
+      case (QUERY_STATS):
+        send_server_stats (sender->sockfd);
+        break;
+      case (LIST_USERS):
+      case (SUBSCRIBE_PRESENCE):
+        if (!sender->is_identified)
+          {
+            printf ("Socket #%d tried to query presence without being identified\n", sender->sockfd);
+            send_packet (sender->sockfd, GENERAL_ERROR, "Must be identified to query users");
+            sockfd = sender->sockfd;
+            client_array_remove_byref (clients, sender);
+            fanout_pool_close (&fanout_pool, sockfd);
+            return false;
+          }
+        request = (presence_request_t *)packet.message;
+        if (packet.code == SUBSCRIBE_PRESENCE)
+          subscribe_presence (clients, sender, request->version);
+        else
+          *list_users = true;
+        break;
       default:
         puts ("unimplemented opcode sent by client");
         break;
     } 
+  return true;
+}
+
+bool
+connection_drained (sockfd_t sockfd)
+/*
+ * everything queued for the connection has been written
+ */
+{
+  outbox_t *outbox;
+  if (!fanout_pool_idle (&fanout_pool, sockfd))
+    return false;
+  outbox = connection_outbox (sockfd, false);
+  return outbox == NULL || !outbox->queued;
+}
+
+bool
+connection_writable (sockfd_t sockfd)
+/*
+ * the connection keeps up well enough to be given more
+ */
+{
+  outbox_t *outbox;
+  if (!fanout_pool_idle (&fanout_pool, sockfd))
+    return false;
+  outbox = connection_outbox (sockfd, false);
+  return outbox == NULL || outbox->queued < OUTBOX_LAG_FRAMES / 2;
+}
+
+struct connection_write_awaiter : coro_until_awaiter {
+  client_pkt_t packet;
+
+  void await_resume () { fanout_pool_send (&fanout_pool, sockfd, &packet); }
+};
+
+typedef struct {
+  client_array_t  *clients;
+  size_t          idx;  /* unlike the client's address, survives the array growing */
+  sockfd_t        sockfd;
+
+  client_t *client () { return &clients->clients[idx]; }
+  /* suspend until the polling loop reads a frame */
+  coro_frame_awaiter read_frame () { return coro_read_frame (); }
+  /* suspend until everything queued has been written */
+  coro_until_awaiter drained () { return coro_until (connection_drained, sockfd); }
+  /* suspend until the connection keeps up, then send `packet` */
+  connection_write_awaiter write (const client_pkt_t *packet)
+  {
+    return connection_write_awaiter{ { connection_writable, sockfd }, *packet };
+  }
+} connection_t;
+
+coro_t
+connection_handler (connection_t conn)
+/*
+ * the life of one connection, top to bottom: identify, get
+ * acknowledged, get announced, then chat. the polling loop
+ * resumes it with each frame, or once what it awaits holds.
+ * finishes only once it dropped the client. the client is
+ * looked up again after every suspension, as accepting
+ * others may have moved it
+ */
+{
+  client_pkt_t packet, page;
+  bool list_users;
+
+  while (!conn.client ()->is_identified)
+    {
+      packet = co_await conn.read_frame ();
+      if (!handle_client_packet (conn.clients, conn.client (), packet, &list_users))
+        co_return;
+    }
+
+  /* nobody should hear of the user before it heard back itself */
+  co_await conn.drained ();
+  presence_index_join (&presence, conn.client ()->ident);  /* announced by `flush_presence` */
+
+  for (;;)
+    {
+      packet = co_await conn.read_frame ();
+      if (!handle_client_packet (conn.clients, conn.client (), packet, &list_users))
+        co_return;
+      else if (!list_users)
+        continue;
+
+      /* a LIST_USERS goes out a page at a time, as fast as the client takes them */
+      presence_request_t *request = (presence_request_t *)packet.message;
+      size_t remaining = request->limit? request->limit: SIZE_MAX;
+      char cursor[15];
+      bool more;
+
+      memcpy (cursor, packet.id, sizeof (cursor));
+      do
+        {
+          more = build_user_list_page (&page, cursor, &remaining);
+          co_await conn.write (&page);
+        }
+      while (more);
+    }
+}
+
+bool
+client_still_present (client_array_t *clients, size_t idx, sockfd_t sockfd)
+/*
+ * handling a packet may have dropped its sender
+ */
+{
+  return clients->free_indices[idx] && clients->clients[idx].sockfd == sockfd;
 }
 
 void
-poll_indefinitely (sockfd_t sockfd)
+drop_client (client_array_t *clients, size_t idx, bool close_connection)
+{
+  client_t *client = &clients->clients[idx];
+  sockfd_t sockfd = client->sockfd;
+  if (client->is_identified)
+    presence_index_leave (&presence, client->ident);
+  coro_destroy (&client->handler);
+  client_array_remove (clients, idx);
+  if (close_connection)
+    fanout_pool_close (&fanout_pool, sockfd);
+}
+
+bool
+deliver_inbound (client_array_t *clients, size_t idx)
+/*
+ * hand the handler whole frames for as long as it wants
+ * them, false once it dropped the client
+ */
+{
+  client_t *client = &clients->clients[idx];
+  sockfd_t sockfd = client->sockfd;
+  size_t offset;
+
+  for (offset = 0; coro_wants_frame (&client->handler)
+                   && offset + sizeof (client_pkt_t) <= client->inbound_len;
+       offset += sizeof (client_pkt_t))
+    {
+      coro_deliver (&client->handler, (client_pkt_t *)(client->inbound + offset));
+      if (!client_still_present (clients, idx, sockfd))
+        return false;
+    }
+
+  client->inbound_len -= offset;
+  memmove (client->inbound, client->inbound + offset, client->inbound_len);
+  return true;
+}
+
+static_assert (CLIENT_INBOUND_SIZE >= READ_DEFICIT_MAX + sizeof (client_pkt_t),
+               "a full read must fit behind a partial frame");
+
+void
+read_client (client_array_t *clients, size_t idx, size_t tick)
+/*
+ * deficit round-robin: each iteration a client earns
+ * READ_QUANTUM bytes and reads at most what it has earned.
+ * one that runs dry forfeits what it didn't use, so idle
+ * clients can't bank a burst. nothing is read while the
+ * handler is busy with something other than frames
+ */
+{
+  client_t *client = &clients->clients[idx];
+  sockfd_t sockfd = client->sockfd;
+  shm_transport_t *shm = local_transport (sockfd);
+  client_pkt_t packet;
+  ssize_t nreceived;
+
+  client->read_deficit += READ_QUANTUM;
+  if (client->read_deficit > READ_DEFICIT_MAX)
+    client->read_deficit = READ_DEFICIT_MAX;
+
+  if (shm != NULL)
+    /* shared-memory client, the socket only carries hangups */
+    {
+      bool popped = false;
+      while (coro_wants_frame (&client->handler) && client->read_deficit >= sizeof (client_pkt_t))
+        {
+          if (!shm_ring_pop (&shm->region->to_server, &packet))
+            {
+              client->read_deficit = 0;
+              break;
+            }
+          popped = true;
+          client->read_deficit -= sizeof (client_pkt_t);
+          coro_deliver (&client->handler, &packet);
+          if (!client_still_present (clients, idx, sockfd))
+            return;
+        }
+      if (popped || (!__atomic_load_n (&shm->region->closed, __ATOMIC_ACQUIRE)
+                     && tick % SHM_LIVENESS_INTERVAL))
+        return;
+      if (!recv (sockfd, &packet, 1, MSG_PEEK))
+        drop_client (clients, idx, true);
+      return;
+    }
+
+  if (!deliver_inbound (clients, idx))
+    return;
+  else if (!coro_wants_frame (&client->handler) || client->inbound_len >= sizeof (client_pkt_t))
+    return;
+
+  nreceived = recv (sockfd, client->inbound + client->inbound_len, client->read_deficit, 0);
+  if (!nreceived)
+    /* indicating EOF */
+    {
+      drop_client (clients, idx, true);
+      return;
+    }
+  else if (nreceived == -1)
+    /* indicating other recv() error */
+    {
+      if (errno == EWOULDBLOCK) /* blocking */
+        client->read_deficit = 0;
+      else if (errno == EBADF) /* bad file descriptor */
+        drop_client (clients, idx, false);
+      else if (errno == ECONNRESET) /* hung up with data still unread */
+        drop_client (clients, idx, true);
+      else
+        printerr ("recv() errored");
+      return;
+    }
+
+  if ((size_t)nreceived < client->read_deficit)
+    client->read_deficit = 0;  /* drained the socket */
+  else
+    client->read_deficit -= nreceived;
+
+  client->inbound_len += nreceived;
+  deliver_inbound (clients, idx);
+}
+
+void
+evict_connection (sockfd_t sockfd)
+/*
+ * tell a client it's being disconnected without waiting
+ * behind its own backlog: everything queued is thrown
+ * away, and the error goes out right after the frame
+ * already on the wire. if the socket can't take it yet,
+ * it lingers half-closed until it does or time runs out
+ */
+{
+  client_pkt_t packet;
+  outbox_t *outbox;
+
+  /* no longer a client, so nothing new gets queued for it */
+  fanout_pool_wait_shard (&fanout_pool, fanout_pool_shard (&fanout_pool, sockfd));
+  if ( (outbox = connection_outbox (sockfd, false)) != NULL)
+    outbox_discard (outbox);
+  build_server_packet (&packet, GENERAL_ERROR, "Too far behind, disconnected");
+  transport_write (sockfd, &packet, monotonic_ns ());
+
+  if ( (outbox = connection_outbox (sockfd, false)) == NULL || !outbox->queued
+      || lingering_len == EVICT_LINGER_MAX)
+    {
+      fanout_pool_close (&fanout_pool, sockfd);
+      return;
+    }
+  shutdown (sockfd, SHUT_RD);
+  lingering[lingering_len].sockfd = sockfd;
+  lingering[lingering_len].deadline_ms = monotonic_ns () / 1000000 + EVICT_LINGER_MS;
+  ++lingering_len;
+}
+
+void
+flush_lingering (void)
+/*
+ * keep writing to evicted clients, closing each once its
+ * error is out or its deadline passed. no writer touches
+ * these sockets anymore, see `evict_connection`
+ */
+{
+  uint64_t now = monotonic_ns () / 1000000;
+  outbox_t *outbox;
+
+  for (size_t idx = 0; idx < lingering_len;)
+    {
+      sockfd_t sockfd = lingering[idx].sockfd;
+      transport_flush (sockfd);
+      outbox = connection_outbox (sockfd, false);
+      if (outbox != NULL && outbox->queued && now < lingering[idx].deadline_ms)
+        {
+          ++idx;
+          continue;
+        }
+      fanout_pool_close (&fanout_pool, sockfd);
+      lingering[idx] = lingering[--lingering_len];
+    }
+}
+
+void
+evict_worst_consumer (client_array_t *clients)
+/*
+ * past the eviction threshold, disconnect whoever has the
+ * most packets waiting on them. one per iteration, so the
+ * shedding done meanwhile gets a say before the next one
+ */
+{
+  outbox_t *outbox;
+  size_t worst_idx = 0, worst_queued = 0, queued;
+
+  if (memory_pressure (&memory_governor) < MEMORY_EVICT)
+    return;
+
+  for (size_t free_idx = 0; free_idx < clients->capacity; ++free_idx)
+    {
+      if (!clients->free_indices[free_idx])
+        continue;
+      else if ( (outbox = connection_outbox (clients->clients[free_idx].sockfd, false)) == NULL)
+        continue;
+      else if ( (queued = __atomic_load_n (&outbox->queued, __ATOMIC_RELAXED)) > worst_queued)
+        {
+          worst_idx = free_idx;
+          worst_queued = queued;
+        }
+    }
+
+  if (!worst_queued)
+    return;  /* the budget is held by fan-out batches, which drain by themselves */
+
+  sockfd_t sockfd = clients->clients[worst_idx].sockfd;
+  printf ("Socket #%d evicted, %zu packets behind\n", sockfd, worst_queued);
+  memory_count (&memory_governor.evicted);
+  drop_client (clients, worst_idx, false);
+  evict_connection (sockfd);
+}
+void
+poll_indefinitely (sockfd_t sockfd, sockfd_t local_sockfd)
 {
   client_array_t clients = {0};
   if (!client_array_create (&clients, 64))
@@ -230,24 +1129,25 @@ poll_indefinitely (sockfd_t sockfd)
       return;
     }
 
-  client_pkt_t current_packet = {0}; 
   client_t current_client = {0};
+  client_t *client;
 
   struct sockaddr_in cl_address;
   sockfd_t cl_sockfd;
   
   unsigned int unused = 0;
-  ssize_t nreceived = 0;
+  size_t tick = 0;
 
   puts ("entering polling loop...");
 
-  for (;;)
+  for (;; ++tick)
     {
       cl_sockfd = accept (sockfd, (struct sockaddr*)(&cl_address), &unused);
       
       /* received client connection */
       if (cl_sockfd > -1)
         {
+          memset (&current_client, 0, sizeof (client_t));
           current_client.sockfd = cl_sockfd;
           current_client.address = cl_address;
           if (!client_array_add (&clients, &current_client))
@@ -259,34 +1159,41 @@ poll_indefinitely (sockfd_t sockfd)
           /* set client socket to blocking */
         }
 
+      if (local_sockfd > -1
+          && (cl_sockfd = accept (local_sockfd, NULL, NULL)) > -1)
+        {
+          memset (&current_client, 0, sizeof (client_t));
+          current_client.sockfd = cl_sockfd;
+          current_client.is_local = true;
+          if (!client_array_add (&clients, &current_client))
+            {
+              puts ("error: failed to append new client");
+              break;
+            }
+          fcntl (cl_sockfd, F_SETFL, fcntl (cl_sockfd, F_GETFL, 0) | O_NONBLOCK);
+        }
+
       for (size_t free_idx = 0; free_idx < clients.capacity; ++free_idx)
         {
           if (!clients.free_indices[free_idx])
             continue;
-          nreceived = recv (clients.clients[free_idx].sockfd, &current_packet, sizeof (client_pkt_t), 0);
-          if (!nreceived)
-            /* indicating EOF */
-            {
-              send_connection_state (&clients, &clients.clients[free_idx], false);
-              client_array_remove (&clients, free_idx);
-              continue;
-            }
-          else if (nreceived == -1)
-            /* indicating other recv() error */
-            {
-              if (errno == EWOULDBLOCK) /* blocking */
-                continue;
-              else if (errno == EBADF) /* bad file descriptor */
-                {
-                  send_connection_state (&clients, &clients.clients[free_idx], false);
-                  client_array_remove (&clients, free_idx);
-                  continue;
-                }
-              printerr ("recv() errored");
-              continue;
-            }
-          handle_client_packet (&clients, &clients.clients[free_idx], current_packet);
+          client = &clients.clients[free_idx];
+          cl_sockfd = client->sockfd;
+          if (fanout_pool_idle (&fanout_pool, cl_sockfd))
+            transport_flush (cl_sockfd);
+          if (!coro_started (&client->handler))
+            client->handler = connection_handler (connection_t{ &clients, free_idx, cl_sockfd });
+          if (!coro_started (&client->handler))
+            continue;  /* out of memory, try again next iteration */
+          else if (coro_poll (&client->handler) == CORO_FINISHED
+                   || !client_still_present (&clients, free_idx, cl_sockfd))
+            continue;
+          read_client (&clients, free_idx, tick);
         }
+
+      flush_presence (&clients);
+      evict_worst_consumer (&clients);
+      flush_lingering ();
     }
 
   ASSERT_NOT_REACHED;  /* there's no reason the main loop should exit as of yet */
@@ -299,17 +1206,53 @@ close_socket (sockfd_t sockfd)
   close (sockfd);
 }
 
+void
+print_usage (const char *argv0)
+{
+  printf ("%s [-w fanout-workers] [-t fanout-threshold] [-u local-socket-path] "
+          "[-m memory-budget-mb] <address> <port>\n", argv0);
+}
+
 int
 main (int argc, char ** argv)
 {
-  if (argc != 3)
+  size_t fanout_workers = FANOUT_DEFAULT_WORKERS;
+  size_t fanout_threshold = FANOUT_DEFAULT_THRESHOLD;
+  const char *local_path = NULL;
+  int option;
+
+  memory_governor.budget = MEMORY_DEFAULT_BUDGET;
+  packet_validator = packet_validator_select ();
+  printf ("validating packets with the %s kernel\n", packet_validator.name);
+
+  while ( (option = getopt (argc, argv, "w:t:u:m:")) != -1)
+    switch (option)
+      {
+        case ('w'):
+          fanout_workers = strtoul (optarg, NULL, 10);  /* 0 disables fan-out */
+          break;
+        case ('t'):
+          fanout_threshold = strtoul (optarg, NULL, 10);
+          break;
+        case ('u'):
+          local_path = optarg;
+          break;
+        case ('m'):
+          memory_governor.budget = strtoul (optarg, NULL, 10) << 20;  /* 0 is unlimited */
+          break;
+        default:
+          print_usage (argv[0]);
+          return EXIT_FAILURE;
+      }
+
+  if (argc - optind != 2)
     {
-      printf ("%s <address> <port>\n", argv[0]);
+      print_usage (argv[0]);
       return EXIT_FAILURE;
     }
 
-  const char *address = argv[1];
-  uint16_t port = atoi (argv[2]);
+  const char *address = argv[optind];
+  uint16_t port = atoi (argv[optind + 1]);
 
   if (port < 30000)
     /* on `atoi` error, 0 is returned, so this is handled */
@@ -327,8 +1270,57 @@ main (int argc, char ** argv)
   if (!start_listening (server_socket, 10 /* backlog */ ))
     return EXIT_FAILURE;
 
-  poll_indefinitely (server_socket);
+  sockfd_t local_socket = -1;
+  if (local_path != NULL)
+    {
+      if ( (local_socket = create_local_server_socket (local_path)) < 0)
+        return EXIT_FAILURE;
+      else if (!start_listening (local_socket, 10 /* backlog */ ))
+        return EXIT_FAILURE;
+
+      local_transports_len = getdtablesize ();
+      local_transports = (shm_transport_t **)calloc (local_transports_len, sizeof (shm_transport_t *));
+      if (local_transports == NULL)
+        {
+          puts ("error: failed to allocate local transport table");
+          return EXIT_FAILURE;
+        }
+    }
+
+  outboxes_len = getdtablesize ();
+  outboxes = (outbox_t **)calloc (outboxes_len, sizeof (outbox_t *));
+  if (outboxes == NULL)
+    {
+      puts ("error: failed to allocate outbox table");
+      return EXIT_FAILURE;
+    }
+
+  if (!presence_index_create (&presence, 64))
+    {
+      puts ("error: failed to create presence index");
+      return EXIT_FAILURE;
+    }
+
+  if (!fanout_pool_create (
+        &fanout_pool, fanout_workers, fanout_threshold,
+        transport_write, transport_close, &memory_governor
+        ))
+    {
+      puts ("error: failed to start fan-out writers");
+      return EXIT_FAILURE;
+    }
+
+  poll_indefinitely (server_socket, local_socket);
+  fanout_pool_free (&fanout_pool);
+  presence_index_free (&presence);
+  free (outboxes);
   close_socket (server_socket);
+  if (local_socket > -1)
+    {
+      close_socket (local_socket);
+      unlink (local_path);
+      free (local_transports);
+    }
 
   return EXIT_SUCCESS;
 }
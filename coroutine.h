@@ -0,0 +1,222 @@
+#ifndef __COROUTINE_H
+#define __COROUTINE_H
+
+/*
+ * C++20 coroutines driven by the polling loop. A handler is
+ * a function returning `coro_t` that reads top to bottom and
+ * `co_await`s whenever it has to wait: for the next frame the
+ * loop hands it, or for a condition on its socket the loop
+ * re-checks every iteration. Locals live in the coroutine
+ * frame and survive every suspension.
+ *
+ * Frames come from a pool of fixed-size blocks recycled
+ * through a free list, so starting a connection costs no
+ * malloc once the pool has grown to the busiest it's been.
+ * Only the polling thread may create or destroy coroutines.
+ */
+
+#include <coroutine>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "pkt_struct.h"
+
+#define CORO_FRAME_SIZE   (2048)  /* bytes, larger frames fall back to malloc */
+#define CORO_POOL_CHUNK   (64)  /* frames the pool grows by */
+
+typedef enum {
+  CORO_SUSPENDED,
+  CORO_FINISHED
+} coro_status_t;
+
+/* what a coroutine waits on besides frames, re-checked by `coro_poll` */
+typedef bool (*coro_cond_fn) (sockfd_t sockfd);
+
+typedef union coro_block {
+  union coro_block *next;  /* while on the free list */
+  alignas (__STDCPP_DEFAULT_NEW_ALIGNMENT__) char bytes[CORO_FRAME_SIZE];
+} coro_block_t;
+
+static coro_block_t *coro_free_blocks;
+
+void*
+coro_frame_alloc (size_t size)
+{
+  coro_block_t *block;
+
+  if (size > CORO_FRAME_SIZE)
+    return malloc (size);
+
+  if (coro_free_blocks == NULL)
+    /* blocks of a chunk are never handed back, only recycled */
+    {
+      coro_block_t *chunk = (coro_block_t *)malloc (sizeof (coro_block_t) * CORO_POOL_CHUNK);
+      if (chunk == NULL)
+        return NULL;
+      for (size_t idx = 0; idx < CORO_POOL_CHUNK; ++idx)
+        {
+          chunk[idx].next = coro_free_blocks;
+          coro_free_blocks = &chunk[idx];
+        }
+    }
+
+  block = coro_free_blocks;
+  coro_free_blocks = block->next;
+  return block;
+}
+
+void
+coro_frame_free (void *frame, size_t size)
+{
+  coro_block_t *block = (coro_block_t *)frame;
+
+  if (size > CORO_FRAME_SIZE)
+    {
+      free (frame);
+      return;
+    }
+  block->next = coro_free_blocks;
+  coro_free_blocks = block;
+}
+
+struct coro_promise;
+typedef std::coroutine_handle<coro_promise> coro_handle_t;
+
+typedef struct {
+  typedef coro_promise promise_type;
+  coro_handle_t handle;  /* empty before it's created and once it finished */
+} coro_t;
+
+struct coro_promise {
+  bool          wants_frame = false;  /* suspended in `coro_read_frame` */
+  client_pkt_t  frame;  /* handed over by `coro_deliver` */
+  coro_cond_fn  until = NULL;  /* suspended in `coro_until`, if set */
+  sockfd_t      until_sockfd = -1;
+
+  coro_t get_return_object () { return coro_t{ coro_handle_t::from_promise (*this) }; }
+  /* started by the first `coro_poll`, like any other resume */
+  std::suspend_always initial_suspend () noexcept { return {}; }
+  /* kept until `coro_resume` sees it's done and frees it */
+  std::suspend_always final_suspend () noexcept { return {}; }
+  void return_void () {}
+  void unhandled_exception () { abort (); }
+
+  static void *operator new (size_t size) noexcept { return coro_frame_alloc (size); }
+  static void operator delete (void *frame, size_t size) { coro_frame_free (frame, size); }
+  /* a NULL from `operator new` makes the call return this, see `coro_started` */
+  static coro_t get_return_object_on_allocation_failure () { return coro_t{}; }
+};
+
+struct coro_frame_awaiter {
+  coro_promise *promise;
+
+  bool await_ready () { return false; }
+  void await_suspend (coro_handle_t handle)
+  {
+    promise = &handle.promise ();
+    promise->wants_frame = true;
+  }
+  client_pkt_t await_resume () { return promise->frame; }
+};
+
+struct coro_until_awaiter {
+  coro_cond_fn  until;
+  sockfd_t      sockfd;
+
+  bool await_ready () { return until (sockfd); }
+  void await_suspend (coro_handle_t handle)
+  {
+    handle.promise ().until = until;
+    handle.promise ().until_sockfd = sockfd;
+  }
+  void await_resume () {}
+};
+
+static inline coro_frame_awaiter
+coro_read_frame (void)
+/*
+ * `co_await` it for the next frame the polling loop reads
+ */
+{
+  return coro_frame_awaiter{ NULL };
+}
+
+static inline coro_until_awaiter
+coro_until (coro_cond_fn until, sockfd_t sockfd)
+/*
+ * `co_await` it until `until (sockfd)` holds
+ */
+{
+  return coro_until_awaiter{ until, sockfd };
+}
+
+bool
+coro_started (coro_t *coro)
+{
+  return (bool)coro->handle;
+}
+
+bool
+coro_wants_frame (coro_t *coro)
+{
+  return coro->handle && coro->handle.promise ().wants_frame;
+}
+
+coro_status_t
+coro_resume (coro_t *coro)
+/*
+ * a finished coroutine is freed right away. it may have
+ * emptied the slot `coro` lives in, which never moves
+ * while it runs, so its handle is read beforehand
+ */
+{
+  coro_handle_t handle = coro->handle;
+  handle.resume ();
+  if (!handle.done ())
+    return CORO_SUSPENDED;
+  handle.destroy ();
+  coro->handle = NULL;
+  return CORO_FINISHED;
+}
+
+coro_status_t
+coro_deliver (coro_t *coro, const client_pkt_t *frame)
+/*
+ * hand a frame to a coroutine suspended in `coro_read_frame`
+ */
+{
+  coro_promise &promise = coro->handle.promise ();
+  memcpy (&promise.frame, frame, sizeof (client_pkt_t));
+  promise.wants_frame = false;
+  return coro_resume (coro);
+}
+
+coro_status_t
+coro_poll (coro_t *coro)
+/*
+ * resume a coroutine that hasn't started yet or whose
+ * condition now holds, one waiting on a frame is left be
+ */
+{
+  coro_promise &promise = coro->handle.promise ();
+  if (promise.wants_frame)
+    return CORO_SUSPENDED;
+  else if (promise.until != NULL && !promise.until (promise.until_sockfd))
+    return CORO_SUSPENDED;
+  promise.until = NULL;
+  return coro_resume (coro);
+}
+
+void
+coro_destroy (coro_t *coro)
+/*
+ * free a suspended coroutine, its locals die with it
+ */
+{
+  if (coro->handle)
+    coro->handle.destroy ();
+  coro->handle = NULL;
+}
+
+#endif  /* __COROUTINE_H */
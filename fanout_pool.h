@@ -0,0 +1,490 @@
+#ifndef __FANOUT_POOL_H
+#define __FANOUT_POOL_H
+
+/*
+ * Writer pool which takes large broadcasts off the
+ * polling loop. Recipients are striped into shards by
+ * `sockfd % FANOUT_SHARDS`, each shard being a FIFO of
+ * jobs that at most one writer drains at a time, so the
+ * order a single socket sees packets in never changes.
+ * Idle writers steal whole shards from each other rather
+ * than being pinned to a fixed range. Within a shard,
+ * control and direct packets overtake queued broadcasts,
+ * but never each other.
+ *
+ * The polling loop is the only producer, which is what
+ * lets `fanout_pool_send` skip the queue entirely for a
+ * socket whose shard has nothing pending.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "pkt_struct.h"
+#include "client_struct.h"
+#include "scheduler.h"
+
+#define FANOUT_SHARDS            (64)
+#define FANOUT_DEFAULT_WORKERS   (4)
+#define FANOUT_DEFAULT_THRESHOLD (1024)
+
+typedef struct {
+  int           refcount;  /* one per job still referencing the batch */
+  memory_governor_t *governor;
+  size_t        size;  /* bytes charged to `governor` */
+  uint64_t      stamp;  /* when the packet was produced */
+  client_pkt_t  packet;
+  sockfd_t      sockfds[];  /* grouped by shard */
+} fanout_batch_t;
+
+/* how a packet actually reaches, or a connection leaves, a socket */
+typedef void (*fanout_write_fn) (sockfd_t sockfd, const client_pkt_t *packet, uint64_t stamp);
+typedef void (*fanout_close_fn) (sockfd_t sockfd);
+/* which clients a broadcast goes to */
+typedef bool (*fanout_filter_fn) (const client_t *client, const void *arg);
+
+typedef enum {
+  FANOUT_SEND,
+  FANOUT_CLOSE
+} fanout_kind_t;
+
+typedef struct fanout_job {
+  struct fanout_job *next;
+  fanout_kind_t   kind;
+  fanout_batch_t  *batch;
+  size_t          offset;  /* range inside `batch->sockfds` */
+  size_t          count;
+} fanout_job_t;
+
+typedef struct {
+  fanout_job_t    *head;
+  fanout_job_t    *tail;
+} fanout_queue_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  fanout_queue_t  urgent;  /* control and direct packets */
+  fanout_queue_t  bulk;  /* broadcasts, and closes which must come last */
+  bool            claimed;  /* a writer is currently draining this shard */
+  size_t          pending;  /* jobs posted but not yet completed */
+  pthread_cond_t  drained;  /* signalled when `pending` drops to 0 */
+} fanout_shard_t;
+
+typedef struct {
+  pthread_t       *workers;
+  size_t          nworkers;
+  size_t          threshold;  /* minimum recipients before fanning out */
+  fanout_write_fn write;
+  fanout_close_fn close;
+  memory_governor_t *governor;  /* charged for batches not yet written */
+  sem_t           wakeup;
+  bool            stopping;
+  fanout_shard_t  shards[FANOUT_SHARDS];
+} fanout_pool_t;
+
+typedef struct {
+  fanout_pool_t *pool;
+  size_t        first_shard;  /* where this writer starts scanning */
+} fanout_worker_arg_t;
+
+static inline fanout_shard_t*
+fanout_pool_shard (fanout_pool_t *pool, sockfd_t sockfd)
+{
+  return &pool->shards[(size_t)sockfd % FANOUT_SHARDS];
+}
+
+void
+fanout_batch_release (fanout_batch_t *batch)
+{
+  if (__atomic_sub_fetch (&batch->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      memory_release (batch->governor, batch->size);
+      free (batch);
+    }
+}
+
+void
+fanout_job_run (fanout_pool_t *pool, fanout_job_t *job)
+{
+  for (size_t idx = job->offset; idx < job->offset + job->count; ++idx)
+    {
+      if (job->kind == FANOUT_CLOSE)
+        pool->close (job->batch->sockfds[idx]);
+      else
+        pool->write (job->batch->sockfds[idx], &job->batch->packet, job->batch->stamp);
+    }
+}
+
+fanout_job_t*
+fanout_queue_pop (fanout_queue_t *queue)
+{
+  fanout_job_t *job = queue->head;
+  if (job == NULL)
+    return NULL;
+  queue->head = job->next;
+  if (queue->head == NULL)
+    queue->tail = NULL;
+  return job;
+}
+
+void
+fanout_queue_push (fanout_queue_t *queue, fanout_job_t *job)
+{
+  job->next = NULL;
+  if (queue->tail != NULL)
+    queue->tail->next = job;
+  else
+    queue->head = job;
+  queue->tail = job;
+}
+
+bool
+fanout_shard_drain (fanout_pool_t *pool, fanout_shard_t *shard)
+/*
+ * claim a shard and run its jobs in order until it
+ * is empty, returns false if there was nothing to claim
+ */
+{
+  fanout_job_t *job;
+
+  pthread_mutex_lock (&shard->lock);
+  if (shard->claimed || (shard->urgent.head == NULL && shard->bulk.head == NULL))
+    {
+      pthread_mutex_unlock (&shard->lock);
+      return false;
+    }
+  shard->claimed = true;
+
+  while ( (job = fanout_queue_pop (&shard->urgent)) != NULL
+          || (job = fanout_queue_pop (&shard->bulk)) != NULL)
+    {
+      pthread_mutex_unlock (&shard->lock);
+
+      fanout_job_run (pool, job);
+      fanout_batch_release (job->batch);
+      free (job);
+
+      pthread_mutex_lock (&shard->lock);
+      /* only published once the sends are done, see `fanout_pool_send` */
+      if (__atomic_sub_fetch (&shard->pending, 1, __ATOMIC_RELEASE) == 0)
+        pthread_cond_signal (&shard->drained);
+    }
+
+  shard->claimed = false;
+  pthread_mutex_unlock (&shard->lock);
+  return true;
+}
+
+void*
+fanout_worker (void *arg)
+{
+  fanout_worker_arg_t worker = *(fanout_worker_arg_t *)arg;
+  fanout_pool_t *pool = worker.pool;
+  free (arg);
+
+  for (;;)
+    {
+      sem_wait (&pool->wakeup);
+      if (__atomic_load_n (&pool->stopping, __ATOMIC_ACQUIRE))
+        break;
+      for (size_t step = 0; step < FANOUT_SHARDS; ++step)
+        fanout_shard_drain (pool, &pool->shards[(worker.first_shard + step) % FANOUT_SHARDS]);
+    }
+
+  return NULL;
+}
+
+void
+fanout_pool_push (fanout_pool_t *pool, fanout_shard_t *shard, fanout_job_t *job)
+{
+  bool urgent = job->kind == FANOUT_SEND
+             && packet_priority (job->batch->packet.code) != PRIORITY_BULK;
+  pthread_mutex_lock (&shard->lock);
+  fanout_queue_push (urgent? &shard->urgent: &shard->bulk, job);
+  __atomic_add_fetch (&shard->pending, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&shard->lock);
+  sem_post (&pool->wakeup);
+}
+
+bool
+fanout_pool_create (
+    fanout_pool_t *pool, size_t nworkers, size_t threshold,
+    fanout_write_fn write, fanout_close_fn close,
+    memory_governor_t *governor
+    )
+/*
+ * initialize pool and spawn `nworkers` writers, a pool
+ * with no writers is valid and simply never fans out
+ */
+{
+  memset (pool, 0, sizeof (fanout_pool_t));
+  pool->threshold = threshold;
+  pool->write = write;
+  pool->close = close;
+  pool->governor = governor;
+
+  for (size_t shard = 0; shard < FANOUT_SHARDS; ++shard)
+    {
+      pthread_mutex_init (&pool->shards[shard].lock, NULL);
+      pthread_cond_init (&pool->shards[shard].drained, NULL);
+    }
+
+  if (sem_init (&pool->wakeup, 0, 0) < 0)
+    return false;
+
+  if (!nworkers)
+    return true;
+
+  pool->workers = (pthread_t *)calloc (nworkers, sizeof (pthread_t));
+  if (pool->workers == NULL)
+    return false;
+
+  for (; pool->nworkers < nworkers; ++pool->nworkers)
+    {
+      fanout_worker_arg_t *arg = (fanout_worker_arg_t *)malloc (sizeof (fanout_worker_arg_t));
+      if (arg == NULL)
+        return false;
+      arg->pool = pool;
+      arg->first_shard = pool->nworkers * (FANOUT_SHARDS / nworkers);
+      if (pthread_create (&pool->workers[pool->nworkers], NULL, fanout_worker, arg) != 0)
+        {
+          free (arg);
+          return false;
+        }
+    }
+
+  return true;
+}
+
+void
+fanout_pool_wait_shard (fanout_pool_t *pool, fanout_shard_t *shard)
+/*
+ * wait for the writers to finish everything queued on
+ * `shard`, after which the polling loop may write to its
+ * sockets itself. only for when a job couldn't be queued
+ */
+{
+  pthread_mutex_lock (&shard->lock);
+  if (shard->pending)
+    /* make sure a writer is on it, then sleep until it's done */
+    sem_post (&pool->wakeup);
+  while (shard->pending)
+    pthread_cond_wait (&shard->drained, &shard->lock);
+  pthread_mutex_unlock (&shard->lock);
+}
+
+bool
+fanout_pool_should_fanout (fanout_pool_t *pool, size_t recipients)
+{
+  return pool->nworkers && recipients >= pool->threshold;
+}
+
+fanout_batch_t*
+fanout_batch_create (fanout_pool_t *pool, client_pkt_t *packet, size_t count)
+/*
+ * NULL past the memory budget too, the caller then sends
+ * inline where the outboxes enforce it
+ */
+{
+  size_t size = sizeof (fanout_batch_t) + sizeof (sockfd_t) * count;
+  if (!memory_try_charge (pool->governor, size, false))
+    return NULL;
+  fanout_batch_t *batch = (fanout_batch_t *)malloc (size);
+  if (batch == NULL)
+    {
+      memory_release (pool->governor, size);
+      return NULL;
+    }
+  batch->refcount = 0;
+  batch->governor = pool->governor;
+  batch->size = size;
+  batch->stamp = monotonic_ns ();
+  if (packet != NULL)
+    memcpy (&batch->packet, packet, sizeof (client_pkt_t));
+  else
+    memset (&batch->packet, 0, sizeof (client_pkt_t));
+  return batch;
+}
+
+bool
+fanout_pool_post_single (
+    fanout_pool_t *pool, sockfd_t sockfd,
+    client_pkt_t *packet, fanout_kind_t kind
+    )
+/*
+ * queue a one-socket job behind whatever its shard holds
+ */
+{
+  fanout_batch_t *batch = fanout_batch_create (pool, packet, 1);
+  fanout_job_t *job = (fanout_job_t *)malloc (sizeof (fanout_job_t));
+  if (batch == NULL || job == NULL)
+    {
+      if (batch != NULL)
+        memory_release (pool->governor, batch->size);
+      free (batch);
+      free (job);
+      return false;
+    }
+  batch->sockfds[0] = sockfd;
+  batch->refcount = 1;
+  job->kind = kind;
+  job->batch = batch;
+  job->offset = 0;
+  job->count = 1;
+  fanout_pool_push (pool, fanout_pool_shard (pool, sockfd), job);
+  return true;
+}
+
+bool
+fanout_pool_broadcast (
+    fanout_pool_t *pool, client_array_t *clients,
+    fanout_filter_fn accept, const void *arg,
+    client_pkt_t *packet
+    )
+/*
+ * snapshot every recipient's socket, grouped by shard,
+ * and hand one job per non-empty shard to the writers.
+ * the polling loop only pays for the two passes below.
+ * false if the caller has to send inline after all, for
+ * an audience under the threshold or lack of memory
+ */
+{
+  size_t counts[FANOUT_SHARDS] = {0};
+  size_t offsets[FANOUT_SHARDS];
+  size_t total = 0, running = 0, njobs = 0;
+
+  if (!pool->nworkers)
+    return false;
+
+  for (size_t free_idx = 0; free_idx < clients->capacity; ++free_idx)
+    {
+      if (!clients->free_indices[free_idx])
+        continue;
+      else if (!accept (&clients->clients[free_idx], arg))
+        continue;
+      ++counts[(size_t)clients->clients[free_idx].sockfd % FANOUT_SHARDS];
+      ++total;
+    }
+
+  if (!total)
+    return true;
+  else if (!fanout_pool_should_fanout (pool, total))
+    return false;
+
+  fanout_batch_t *batch = fanout_batch_create (pool, packet, total);
+  if (batch == NULL)
+    return false;
+
+  for (size_t shard = 0; shard < FANOUT_SHARDS; ++shard)
+    {
+      offsets[shard] = running;
+      running += counts[shard];
+      if (counts[shard])
+        ++njobs;
+    }
+
+  for (size_t free_idx = 0; free_idx < clients->capacity; ++free_idx)
+    {
+      if (!clients->free_indices[free_idx])
+        continue;
+      else if (!accept (&clients->clients[free_idx], arg))
+        continue;
+      sockfd_t sockfd = clients->clients[free_idx].sockfd;
+      batch->sockfds[offsets[(size_t)sockfd % FANOUT_SHARDS]++] = sockfd;
+    }
+
+  /* `offsets` now point one past the end of each shard's range */
+  batch->refcount = njobs;  /* set before any writer can see the batch */
+
+  for (size_t shard = 0; shard < FANOUT_SHARDS; ++shard)
+    {
+      if (!counts[shard])
+        continue;
+      fanout_job_t *job = (fanout_job_t *)malloc (sizeof (fanout_job_t));
+      if (job == NULL)
+        {
+          /* sends would be lost for this shard, do them inline once it's ours */
+          fanout_pool_wait_shard (pool, &pool->shards[shard]);
+          for (size_t idx = offsets[shard] - counts[shard]; idx < offsets[shard]; ++idx)
+            pool->write (batch->sockfds[idx], packet, batch->stamp);
+          fanout_batch_release (batch);
+          continue;
+        }
+      job->kind = FANOUT_SEND;
+      job->batch = batch;
+      job->offset = offsets[shard] - counts[shard];
+      job->count = counts[shard];
+      fanout_pool_push (pool, &pool->shards[shard], job);
+    }
+
+  return true;
+}
+
+bool
+fanout_pool_idle (fanout_pool_t *pool, sockfd_t sockfd)
+/*
+ * true when no writer owes this socket anything
+ */
+{
+  return __atomic_load_n (&fanout_pool_shard (pool, sockfd)->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+void
+fanout_pool_send (fanout_pool_t *pool, sockfd_t sockfd, client_pkt_t *packet)
+/*
+ * send directly unless a writer still owes this socket
+ * an earlier packet, in which case queue behind it, or
+ * ahead of its broadcasts if this is a control/direct one
+ */
+{
+  if (!fanout_pool_idle (pool, sockfd)
+      && fanout_pool_post_single (pool, sockfd, packet, FANOUT_SEND))
+    return;
+  fanout_pool_wait_shard (pool, fanout_pool_shard (pool, sockfd));
+  pool->write (sockfd, packet, monotonic_ns ());
+}
+
+void
+fanout_pool_close (fanout_pool_t *pool, sockfd_t sockfd)
+/*
+ * the descriptor can't be released while a writer may
+ * still send to it, otherwise a new connection reusing
+ * the number would receive someone else's packets
+ */
+{
+  if (!fanout_pool_idle (pool, sockfd)
+      && fanout_pool_post_single (pool, sockfd, NULL, FANOUT_CLOSE))
+    return;
+  fanout_pool_wait_shard (pool, fanout_pool_shard (pool, sockfd));
+  pool->close (sockfd);
+}
+
+void
+fanout_pool_free (fanout_pool_t *pool)
+/*
+ * writers finish every queued job before exiting
+ */
+{
+  for (size_t shard = 0; shard < FANOUT_SHARDS; ++shard)
+    fanout_pool_wait_shard (pool, &pool->shards[shard]);
+
+  __atomic_store_n (&pool->stopping, true, __ATOMIC_RELEASE);
+  for (size_t worker = 0; worker < pool->nworkers; ++worker)
+    sem_post (&pool->wakeup);
+  for (size_t worker = 0; worker < pool->nworkers; ++worker)
+    pthread_join (pool->workers[worker], NULL);
+
+  for (size_t shard = 0; shard < FANOUT_SHARDS; ++shard)
+    {
+      pthread_mutex_destroy (&pool->shards[shard].lock);
+      pthread_cond_destroy (&pool->shards[shard].drained);
+    }
+  sem_destroy (&pool->wakeup);
+  free (pool->workers);
+}
+
+#endif  /* __FANOUT_POOL_H */
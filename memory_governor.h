@@ -0,0 +1,123 @@
+#ifndef __MEMORY_GOVERNOR_H
+#define __MEMORY_GOVERNOR_H
+
+/*
+ * Server-wide budget for outbound data the server is holding
+ * on to: client outboxes and fan-out batches not yet written.
+ * Usage past each threshold escalates the response:
+ *
+ *  - shed:  lagging clients lose their oldest queued broadcasts
+ *  - evict: the client holding the most is disconnected
+ *  - full:  nothing but control packets gets queued at all, and
+ *           no new fan-out batches are created
+ *
+ * so one slow consumer can't take the whole server down with it.
+ * "full" is the budget less a reserve kept for control packets,
+ * which are refused in turn once the whole budget is in use.
+ * the only charge never refused is the rest of a partly written
+ * frame, at most one per connection: its head is on the wire.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define MEMORY_DEFAULT_BUDGET  (256 << 20)  /* bytes */
+#define MEMORY_SHED_PERCENT    (50)
+#define MEMORY_EVICT_PERCENT   (80)
+#define MEMORY_RESERVE_PERCENT (10)  /* of the budget, for control packets */
+
+typedef enum {
+  MEMORY_OK,
+  MEMORY_SHED,
+  MEMORY_EVICT,
+  MEMORY_FULL
+} memory_pressure_t;
+
+typedef struct {
+  size_t budget;  /* 0 for unlimited */
+  size_t used;
+  size_t shed;  /* broadcasts dropped for lagging clients */
+  size_t refused;  /* packets not queued at all for lack of room */
+  size_t evicted;  /* clients disconnected for lagging */
+} memory_governor_t;
+
+void
+memory_charge (memory_governor_t *governor, size_t bytes)
+{
+  __atomic_add_fetch (&governor->used, bytes, __ATOMIC_RELAXED);
+}
+
+void
+memory_release (memory_governor_t *governor, size_t bytes)
+{
+  __atomic_sub_fetch (&governor->used, bytes, __ATOMIC_RELAXED);
+}
+
+size_t
+memory_ceiling (memory_governor_t *governor, bool reserve)
+/*
+ * the most that may be in use, the last slice of the
+ * budget only for charges allowed into the reserve
+ */
+{
+  if (reserve)
+    return governor->budget;
+  return governor->budget / 100 * (100 - MEMORY_RESERVE_PERCENT);
+}
+
+bool
+memory_try_charge (memory_governor_t *governor, size_t bytes, bool reserve)
+/*
+ * charges `bytes` unless that takes usage past the ceiling.
+ * checked and charged in one step, so threads charging at
+ * once can't overshoot it together
+ */
+{
+  size_t used = __atomic_load_n (&governor->used, __ATOMIC_RELAXED);
+  if (!governor->budget)
+    {
+      memory_charge (governor, bytes);
+      return true;
+    }
+  do
+    if (used + bytes > memory_ceiling (governor, reserve))
+      return false;
+  while (!__atomic_compare_exchange_n (&governor->used, &used, used + bytes, true,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return true;
+}
+
+void
+memory_count (size_t *counter)
+{
+  __atomic_add_fetch (counter, 1, __ATOMIC_RELAXED);
+}
+
+memory_pressure_t
+memory_pressure (memory_governor_t *governor)
+{
+  size_t used = __atomic_load_n (&governor->used, __ATOMIC_RELAXED);
+  if (!governor->budget)
+    return MEMORY_OK;
+  else if (used >= memory_ceiling (governor, false))
+    return MEMORY_FULL;
+  else if (used >= governor->budget / 100 * MEMORY_EVICT_PERCENT)
+    return MEMORY_EVICT;
+  else if (used >= governor->budget / 100 * MEMORY_SHED_PERCENT)
+    return MEMORY_SHED;
+  return MEMORY_OK;
+}
+
+void
+memory_governor_format (memory_governor_t *governor, char *buffer, size_t size)
+{
+  snprintf (buffer, size, "memory: used=%zuKB budget=%zuKB shed=%zu refused=%zu evicted=%zu",
+            __atomic_load_n (&governor->used, __ATOMIC_RELAXED) >> 10,
+            governor->budget >> 10,
+            __atomic_load_n (&governor->shed, __ATOMIC_RELAXED),
+            __atomic_load_n (&governor->refused, __ATOMIC_RELAXED),
+            __atomic_load_n (&governor->evicted, __ATOMIC_RELAXED));
+}
+
+#endif  /* __MEMORY_GOVERNOR_H */
@@ -0,0 +1,408 @@
+#ifndef __PACKET_VALIDATOR_H
+#define __PACKET_VALIDATOR_H
+
+/*
+ * Validation of the text fields clients send. An ident has
+ * to be NUL-terminated within its 15 bytes and may only use
+ * letters, digits and `_-.`; a message has to be terminated
+ * within its 128 bytes, be well-formed UTF-8 and hold no
+ * control characters. Whatever follows the terminator is
+ * zeroed, so nothing a client left there gets relayed.
+ *
+ * Each field is checked in one pass over registers. The
+ * AVX2 kernel covers UTF-8 as well, with the lookup tables
+ * of Keiser and Lemire's validator; the SSE2 one only has
+ * the all-ASCII fast path and hands multi-byte text to the
+ * scalar code. `packet_validator_select` picks the best
+ * kernel the CPU supports.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined (__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define IDENT_FIELD_SIZE  (15)
+#define TEXT_FIELD_SIZE   (128)
+
+typedef enum {
+  FIELD_VALID,
+  FIELD_UNTERMINATED,
+  FIELD_BAD_CHARSET,  /* idents only */
+  FIELD_CONTROL,
+  FIELD_BAD_UTF8,
+  FIELD_STATUSES
+} field_status_t;
+
+static const char *field_status_names[FIELD_STATUSES] = {
+  "valid", "not terminated", "invalid character in name",
+  "control character", "invalid UTF-8"
+};
+
+typedef struct {
+  const char      *name;
+  field_status_t  (*ident) (char *ident);
+  field_status_t  (*text) (char *text);
+  size_t          rejected;  /* packets turned away */
+} packet_validator_t;
+
+/*
+ * scalar kernels, the reference for the vector ones
+ */
+
+static inline bool
+ident_char_allowed (unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+      || (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+}
+
+bool
+utf8_valid_scalar (const unsigned char *text, size_t length)
+/*
+ * rejects overlong forms, surrogates and anything
+ * past U+10FFFF, as well as truncated sequences
+ */
+{
+  size_t idx = 0;
+  while (idx < length)
+    {
+      unsigned char lead = text[idx];
+      uint32_t point, least;
+      size_t extra;
+
+      if (lead < 0x80)
+        {
+          ++idx;
+          continue;
+        }
+      else if ((lead & 0xe0) == 0xc0)
+        extra = 1, point = lead & 0x1f, least = 0x80;
+      else if ((lead & 0xf0) == 0xe0)
+        extra = 2, point = lead & 0x0f, least = 0x800;
+      else if ((lead & 0xf8) == 0xf0)
+        extra = 3, point = lead & 0x07, least = 0x10000;
+      else
+        return false;
+
+      if (length - idx <= extra)
+        return false;
+      for (size_t k = 1; k <= extra; ++k)
+        {
+          if ((text[idx + k] & 0xc0) != 0x80)
+            return false;
+          point = (point << 6) | (text[idx + k] & 0x3f);
+        }
+      if (point < least || point > 0x10ffff || (point >= 0xd800 && point <= 0xdfff))
+        return false;
+      idx += extra + 1;
+    }
+  return true;
+}
+
+field_status_t
+validate_ident_scalar (char *ident)
+{
+  size_t length = 0;
+  while (length < IDENT_FIELD_SIZE && ident[length])
+    ++length;
+  if (length == IDENT_FIELD_SIZE)
+    return FIELD_UNTERMINATED;
+
+  for (size_t idx = 0; idx < length; ++idx)
+    if (!ident_char_allowed (ident[idx]))
+      return FIELD_BAD_CHARSET;
+
+  memset (ident + length, 0, IDENT_FIELD_SIZE - length);
+  return FIELD_VALID;
+}
+
+field_status_t
+validate_text_scalar (char *text)
+{
+  const unsigned char *bytes = (const unsigned char *)text;
+  size_t length = 0;
+  while (length < TEXT_FIELD_SIZE && bytes[length])
+    ++length;
+  if (length == TEXT_FIELD_SIZE)
+    return FIELD_UNTERMINATED;
+
+  for (size_t idx = 0; idx < length; ++idx)
+    if (bytes[idx] < 0x20 || bytes[idx] == 0x7f)
+      return FIELD_CONTROL;
+  if (!utf8_valid_scalar (bytes, length))
+    return FIELD_BAD_UTF8;
+
+  memset (text + length, 0, TEXT_FIELD_SIZE - length);
+  return FIELD_VALID;
+}
+
+#if defined (__x86_64__)
+
+/*
+ * SSE2, part of every x86-64 CPU
+ */
+
+static inline __m128i
+sse2_in_range (__m128i bytes, char low, char high)
+/*
+ * `low` <= byte <= `high` for ASCII bounds, bytes
+ * past 0x7f compare negative and never match
+ */
+{
+  return _mm_and_si128 (_mm_cmpgt_epi8 (bytes, _mm_set1_epi8 (low - 1)),
+                        _mm_cmplt_epi8 (bytes, _mm_set1_epi8 (high + 1)));
+}
+
+static inline __m128i
+sse2_control (__m128i bytes)
+/*
+ * 0x01-0x1f and 0x7f, NUL is padding by now
+ */
+{
+  return _mm_or_si128 (sse2_in_range (bytes, 0x01, 0x1f),
+                       _mm_cmpeq_epi8 (bytes, _mm_set1_epi8 (0x7f)));
+}
+
+field_status_t
+validate_ident_sse2 (char *ident)
+{
+  char field[16] = {0};
+  const __m128i index = _mm_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i bytes, in_name, allowed;
+  unsigned int nuls;
+
+  memcpy (field, ident, IDENT_FIELD_SIZE);
+  bytes = _mm_loadu_si128 ((const __m128i *)field);
+  nuls = _mm_movemask_epi8 (_mm_cmpeq_epi8 (bytes, _mm_setzero_si128 ())) & 0x7fff;
+  if (!nuls)
+    return FIELD_UNTERMINATED;
+
+  in_name = _mm_cmplt_epi8 (index, _mm_set1_epi8 (__builtin_ctz (nuls)));
+  bytes = _mm_and_si128 (bytes, in_name);
+  allowed = _mm_or_si128 (
+      sse2_in_range (_mm_or_si128 (bytes, _mm_set1_epi8 (0x20)), 'a', 'z'),  /* either case */
+      sse2_in_range (bytes, '0', '9'));
+  allowed = _mm_or_si128 (allowed, _mm_cmpeq_epi8 (bytes, _mm_set1_epi8 ('_')));
+  allowed = _mm_or_si128 (allowed, _mm_cmpeq_epi8 (bytes, _mm_set1_epi8 ('-')));
+  allowed = _mm_or_si128 (allowed, _mm_cmpeq_epi8 (bytes, _mm_set1_epi8 ('.')));
+  if (_mm_movemask_epi8 (_mm_andnot_si128 (allowed, in_name)))
+    return FIELD_BAD_CHARSET;
+
+  _mm_storeu_si128 ((__m128i *)field, bytes);
+  memcpy (ident, field, IDENT_FIELD_SIZE);
+  return FIELD_VALID;
+}
+
+field_status_t
+validate_text_sse2 (char *text)
+{
+  __m128i blocks[8], control = _mm_setzero_si128 (), high = _mm_setzero_si128 ();
+  uint64_t nuls[2] = {0};
+  size_t length;
+
+  for (size_t block = 0; block < 8; ++block)
+    {
+      blocks[block] = _mm_loadu_si128 ((const __m128i *)(text + 16 * block));
+      nuls[block / 4] |= (uint64_t)_mm_movemask_epi8 (
+          _mm_cmpeq_epi8 (blocks[block], _mm_setzero_si128 ())) << (16 * (block % 4));
+    }
+  if (nuls[0])
+    length = __builtin_ctzll (nuls[0]);
+  else if (nuls[1])
+    length = 64 + __builtin_ctzll (nuls[1]);
+  else
+    return FIELD_UNTERMINATED;
+
+  for (size_t block = 0; block < 8; ++block)
+    {
+      __m128i index = _mm_add_epi8 (
+          _mm_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+          _mm_set1_epi8 (16 * block));
+      blocks[block] = _mm_and_si128 (blocks[block], _mm_cmplt_epi8 (index, _mm_set1_epi8 (length)));
+      control = _mm_or_si128 (control, sse2_control (blocks[block]));
+      high = _mm_or_si128 (high, blocks[block]);
+    }
+  if (_mm_movemask_epi8 (control))
+    return FIELD_CONTROL;
+  if (_mm_movemask_epi8 (high) && !utf8_valid_scalar ((const unsigned char *)text, length))
+    return FIELD_BAD_UTF8;
+
+  for (size_t block = 0; block < 8; ++block)
+    _mm_storeu_si128 ((__m128i *)(text + 16 * block), blocks[block]);
+  return FIELD_VALID;
+}
+
+/*
+ * AVX2, UTF-8 checked by classifying every byte together
+ * with the one before it by their nibbles, plus a check
+ * that third and fourth bytes of a sequence are continuations
+ */
+
+#define UTF8_TOO_SHORT       (0x01)
+#define UTF8_TOO_LONG        (0x02)
+#define UTF8_OVERLONG_3      (0x04)
+#define UTF8_TOO_LARGE       (0x08)
+#define UTF8_SURROGATE       (0x10)
+#define UTF8_OVERLONG_2      (0x20)
+#define UTF8_TOO_LARGE_1000  (0x40)
+#define UTF8_OVERLONG_4      (0x40)
+#define UTF8_TWO_CONTS       (0x80)
+#define UTF8_CARRY           (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const uint8_t utf8_byte_1_high[16] = {
+  /* 0___ */
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  /* 10__ */
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+  /* 1100, 1101, 1110, 1111 */
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+  UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+static const uint8_t utf8_byte_1_low[16] = {
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+  UTF8_CARRY | UTF8_OVERLONG_2,
+  UTF8_CARRY,
+  UTF8_CARRY,
+  UTF8_CARRY | UTF8_TOO_LARGE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+static const uint8_t utf8_byte_2_high[16] = {
+  /* 0___ */
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  /* 1000, 1001, 101_ */
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+  /* 11__ */
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/* the last `count` bytes of `previous` followed by the start of `input` */
+#define AVX2_PREVIOUS(input, previous, count) \
+  _mm256_alignr_epi8 ((input), _mm256_permute2x128_si256 ((previous), (input), 0x21), 16 - (count))
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+avx2_lookup (const uint8_t table[16], __m256i nibbles)
+{
+  return _mm256_shuffle_epi8 (
+      _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *)table)), nibbles);
+}
+
+__attribute__ ((target ("avx2"))) static inline __m256i
+avx2_utf8_errors (__m256i input, __m256i previous)
+/*
+ * nonzero bytes wherever `input` breaks UTF-8, given
+ * the block before it
+ */
+{
+  const __m256i low_nibble = _mm256_set1_epi8 (0x0f);
+  __m256i prev1 = AVX2_PREVIOUS (input, previous, 1);
+  __m256i special = _mm256_and_si256 (
+      _mm256_and_si256 (
+          avx2_lookup (utf8_byte_1_high, _mm256_and_si256 (_mm256_srli_epi16 (prev1, 4), low_nibble)),
+          avx2_lookup (utf8_byte_1_low, _mm256_and_si256 (prev1, low_nibble))),
+      avx2_lookup (utf8_byte_2_high, _mm256_and_si256 (_mm256_srli_epi16 (input, 4), low_nibble)));
+
+  /* only 111_____ and 1111____ leads get to 0x80 and up */
+  __m256i third = _mm256_subs_epu8 (AVX2_PREVIOUS (input, previous, 2), _mm256_set1_epi8 (0xe0 - 0x80));
+  __m256i fourth = _mm256_subs_epu8 (AVX2_PREVIOUS (input, previous, 3), _mm256_set1_epi8 (0xf0 - 0x80));
+  __m256i must_continue = _mm256_and_si256 (_mm256_or_si256 (third, fourth), _mm256_set1_epi8 ((char)0x80));
+
+  return _mm256_xor_si256 (must_continue, special);
+}
+
+__attribute__ ((target ("avx2"))) field_status_t
+validate_text_avx2 (char *text)
+/*
+ * the padding is zeroed before UTF-8 is checked, so a
+ * sequence cut short by the terminator shows as too short
+ */
+{
+  __m256i blocks[4], control = _mm256_setzero_si256 (), errors = _mm256_setzero_si256 ();
+  __m256i previous = _mm256_setzero_si256 (), high = _mm256_setzero_si256 ();
+  uint64_t nuls[2] = {0};
+  size_t length;
+
+  for (size_t block = 0; block < 4; ++block)
+    {
+      blocks[block] = _mm256_loadu_si256 ((const __m256i *)(text + 32 * block));
+      nuls[block / 2] |= (uint64_t)(uint32_t)_mm256_movemask_epi8 (
+          _mm256_cmpeq_epi8 (blocks[block], _mm256_setzero_si256 ())) << (32 * (block % 2));
+    }
+  if (nuls[0])
+    length = __builtin_ctzll (nuls[0]);
+  else if (nuls[1])
+    length = 64 + __builtin_ctzll (nuls[1]);
+  else
+    return FIELD_UNTERMINATED;
+
+  for (size_t block = 0; block < 4; ++block)
+    {
+      __m256i index = _mm256_add_epi8 (
+          _mm256_setr_epi8 (0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                            16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31),
+          _mm256_set1_epi8 (32 * block));
+      __m256i bytes = _mm256_and_si256 (
+          blocks[block], _mm256_cmpgt_epi8 (_mm256_set1_epi8 (length), index));
+
+      control = _mm256_or_si256 (control, _mm256_and_si256 (
+          _mm256_cmpgt_epi8 (bytes, _mm256_setzero_si256 ()),
+          _mm256_cmpgt_epi8 (_mm256_set1_epi8 (0x20), bytes)));
+      control = _mm256_or_si256 (control, _mm256_cmpeq_epi8 (bytes, _mm256_set1_epi8 (0x7f)));
+      errors = _mm256_or_si256 (errors, avx2_utf8_errors (bytes, previous));
+      high = _mm256_or_si256 (high, bytes);
+      blocks[block] = previous = bytes;
+    }
+  if (_mm256_movemask_epi8 (control))
+    return FIELD_CONTROL;
+  if (_mm256_movemask_epi8 (high) && !_mm256_testz_si256 (errors, errors))
+    return FIELD_BAD_UTF8;
+
+  for (size_t block = 0; block < 4; ++block)
+    _mm256_storeu_si256 ((__m256i *)(text + 32 * block), blocks[block]);
+  return FIELD_VALID;
+}
+
+#endif  /* __x86_64__ */
+
+packet_validator_t
+packet_validator_select (void)
+{
+  packet_validator_t validator = { "scalar", validate_ident_scalar, validate_text_scalar, 0 };
+#if defined (__x86_64__)
+  __builtin_cpu_init ();
+  validator.name = "sse2";
+  validator.ident = validate_ident_sse2;
+  validator.text = validate_text_sse2;
+  if (__builtin_cpu_supports ("avx2"))
+    {
+      validator.name = "avx2";
+      validator.text = validate_text_avx2;
+    }
+#endif
+  return validator;
+}
+
+#endif  /* __PACKET_VALIDATOR_H */
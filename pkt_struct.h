@@ -22,7 +22,38 @@ enum {
   GENERAL_ERROR,
   CONNECT_ACK,
   INVALID_IDENT,
-  INVALID_PM_IDENT
+  INVALID_PM_IDENT,
+  LIST_USERS,          /* id: cursor, message: presence_request_t */
+  USER_LIST,           /* message: presence_page_t */
+  SUBSCRIBE_PRESENCE,  /* message: presence_request_t */
+  PRESENCE_DELTA,      /* message: presence_page_t */
+  PRESENCE_RESYNC,     /* message: presence_page_t, version only */
+  QUERY_STATS,
+  SERVER_STATS,        /* message: one line of text per packet */
+  PACKET_REJECTED      /* message: why, the connection stays open */
 };
 
+/*
+ * LIST_USERS pages through the users sorted by ident,
+ * starting after the ident in `id` (empty for the start),
+ * until `limit` idents were sent (0 for all of them).
+ * SUBSCRIBE_PRESENCE replays every change after `version`
+ * and keeps sending PRESENCE_DELTA batches from then on,
+ * or answers PRESENCE_RESYNC if `version` is too old
+ */
+typedef struct {
+  uint32_t  version;
+  uint16_t  limit;
+} presence_request_t;
+
+#define PRESENCE_PAGE_IDENTS (8)
+#define PRESENCE_PAGE_MORE   (1)  /* USER_LIST flag, further idents follow */
+
+typedef struct {
+  uint32_t  version;  /* presence version the page reflects */
+  uint8_t   count;
+  uint8_t   flags;  /* PRESENCE_DELTA: bit i set if idents[i] joined, else left */
+  char      idents[PRESENCE_PAGE_IDENTS][15];
+} presence_page_t;
+
 #endif  /* __CONFSERVER_H */
@@ -0,0 +1,148 @@
+#ifndef __PRESENCE_H
+#define __PRESENCE_H
+
+/*
+ * Presence index: every identified user kept sorted by
+ * ident so LIST_USERS can page through it with a cursor,
+ * plus a ring of the most recent joins/leaves so that a
+ * subscriber can ask for "everything since version V"
+ * instead of refetching the whole list.
+ *
+ * Version N is the state after the N-th change; the
+ * change that produced it lives in `log[(N - 1) % size]`.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PRESENCE_LOG_SIZE       (4096)
+#define PRESENCE_IDENT_SIZE     (15)
+#define PRESENCE_DEFAULT_EXPAND (64)
+
+typedef struct {
+  char  ident[PRESENCE_IDENT_SIZE];
+  bool  joined;
+} presence_change_t;
+
+typedef struct {
+  char              (*idents)[PRESENCE_IDENT_SIZE];  /* sorted, NUL-padded */
+  size_t            size;
+  size_t            capacity;
+  uint32_t          version;
+  uint32_t          flushed_version;  /* last version announced to clients */
+  presence_change_t log[PRESENCE_LOG_SIZE];
+} presence_index_t;
+
+bool
+presence_index_create (presence_index_t *index, size_t capacity)
+{
+  memset (index, 0, sizeof (presence_index_t));
+  index->idents = (char (*)[PRESENCE_IDENT_SIZE])calloc (capacity, PRESENCE_IDENT_SIZE);
+  if (index->idents == NULL)
+    return false;
+  index->capacity = capacity;
+  return true;
+}
+
+size_t
+presence_index_upper_bound (presence_index_t *index, const char *ident)
+/*
+ * position of the first ident sorting after `ident`,
+ * an empty `ident` therefore means the very start
+ */
+{
+  size_t low = 0, high = index->size;
+  while (low < high)
+    {
+      size_t mid = low + (high - low) / 2;
+      if (strncmp (index->idents[mid], ident, PRESENCE_IDENT_SIZE) <= 0)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+  return low;
+}
+
+void
+presence_index_record (presence_index_t *index, const char *ident, bool joined)
+{
+  presence_change_t *change = &index->log[index->version % PRESENCE_LOG_SIZE];
+  memset (change->ident, 0, PRESENCE_IDENT_SIZE);
+  strncpy (change->ident, ident, PRESENCE_IDENT_SIZE - 1);
+  change->joined = joined;
+  ++index->version;
+}
+
+bool
+presence_index_join (presence_index_t *index, const char *ident)
+{
+  size_t position = presence_index_upper_bound (index, ident);
+
+  if (position && !strncmp (index->idents[position - 1], ident, PRESENCE_IDENT_SIZE))
+    return false;  /* already present */
+
+  if (index->size == index->capacity)
+    {
+      void *idents = realloc (index->idents, PRESENCE_IDENT_SIZE * (index->capacity + PRESENCE_DEFAULT_EXPAND));
+      if (idents == NULL)
+        return false;
+      index->idents = (char (*)[PRESENCE_IDENT_SIZE])idents;
+      index->capacity += PRESENCE_DEFAULT_EXPAND;
+    }
+
+  memmove (&index->idents[position + 1], &index->idents[position],
+           PRESENCE_IDENT_SIZE * (index->size - position));
+  memset (index->idents[position], 0, PRESENCE_IDENT_SIZE);
+  strncpy (index->idents[position], ident, PRESENCE_IDENT_SIZE - 1);
+  ++index->size;
+
+  presence_index_record (index, ident, true);
+  return true;
+}
+
+bool
+presence_index_leave (presence_index_t *index, const char *ident)
+{
+  size_t position = presence_index_upper_bound (index, ident);
+
+  if (!position || strncmp (index->idents[position - 1], ident, PRESENCE_IDENT_SIZE))
+    return false;  /* not present */
+
+  --position;
+  memmove (&index->idents[position], &index->idents[position + 1],
+           PRESENCE_IDENT_SIZE * (index->size - position - 1));
+  --index->size;
+
+  presence_index_record (index, ident, false);
+  return true;
+}
+
+bool
+presence_index_has_since (presence_index_t *index, uint32_t version)
+/*
+ * whether every change after `version` is still in the log
+ */
+{
+  return version <= index->version
+      && index->version - version <= PRESENCE_LOG_SIZE;
+}
+
+presence_change_t*
+presence_index_change (presence_index_t *index, uint32_t version)
+/*
+ * the change which produced `version`, must satisfy
+ * `presence_index_has_since (index, version - 1)`
+ */
+{
+  return &index->log[(version - 1) % PRESENCE_LOG_SIZE];
+}
+
+void
+presence_index_free (presence_index_t *index)
+{
+  free (index->idents);
+}
+
+#endif  /* __PRESENCE_H */
@@ -0,0 +1,376 @@
+#ifndef __SCHEDULER_H
+#define __SCHEDULER_H
+
+/*
+ * Fairness and priority for per-client work.
+ *
+ * Inbound, every client earns a quantum of bytes per loop
+ * iteration and may read up to what it has earned (deficit
+ * round-robin), so a chatty client can't hog an iteration.
+ *
+ * Outbound, packets are sorted into priority classes. A
+ * socket that can't take everything keeps the rest in its
+ * outbox, which is always drained control first, then
+ * direct traffic, then bulk broadcasts. Order within a
+ * class never changes.
+ *
+ * Every packet is stamped when produced and its delay until
+ * it fully left the server is recorded per class.
+ *
+ * Outboxes are charged to the memory governor, and under
+ * pressure a lagging client only keeps its newest broadcasts.
+ * Presence deltas are never shed, but past the budget they
+ * are replaced by a single PRESENCE_RESYNC.
+ */
+
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "pkt_struct.h"
+#include "memory_governor.h"
+
+#define READ_QUANTUM       (4 * sizeof (client_pkt_t))  /* bytes earned per iteration */
+#define READ_DEFICIT_MAX   (2 * READ_QUANTUM)  /* an idle client can't bank more */
+#define LATENCY_BUCKETS    (32)  /* log2 microseconds */
+#define OUTBOX_LAG_FRAMES  (64)  /* broadcasts a lagging client keeps under pressure */
+#define OUTBOX_CONTROL_FRAMES (16)  /* control packets a client may have waiting */
+
+typedef enum {
+  PRIORITY_CONTROL,  /* acks, errors, resyncs */
+  PRIORITY_DIRECT,  /* private messages and query replies */
+  PRIORITY_BULK,  /* broadcasts */
+  PRIORITY_CLASSES
+} priority_t;
+
+static const char *priority_names[PRIORITY_CLASSES] = {
+  "control", "direct", "bulk"
+};
+
+static inline priority_t
+packet_priority (uint8_t code)
+{
+  switch (code)
+    {
+      case (CONNECT_ACK):
+      case (INVALID_IDENT):
+      case (INVALID_PM_IDENT):
+      case (GENERAL_ERROR):
+      case (PRESENCE_RESYNC):
+        return PRIORITY_CONTROL;
+      case (PRIVATE_MESSAGE):
+      case (USER_LIST):
+      case (SERVER_STATS):
+      case (PACKET_REJECTED):
+        return PRIORITY_DIRECT;
+      default:
+        return PRIORITY_BULK;
+    }
+}
+
+static inline uint64_t
+monotonic_ns (void)
+{
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * latency histograms, written to by the polling loop and
+ * the fan-out writers alike
+ */
+
+typedef struct {
+  uint64_t buckets[PRIORITY_CLASSES][LATENCY_BUCKETS];  /* bucket i: < 2^i us */
+} latency_stats_t;
+
+void
+latency_stats_record (latency_stats_t *stats, priority_t priority, uint64_t stamp)
+{
+  uint64_t micros = (monotonic_ns () - stamp) / 1000;
+  size_t bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && micros >= (1ull << bucket))
+    ++bucket;
+  __atomic_add_fetch (&stats->buckets[priority][bucket], 1, __ATOMIC_RELAXED);
+}
+
+void
+latency_stats_format (
+    latency_stats_t *stats, priority_t priority,
+    char *buffer, size_t size
+    )
+/*
+ * "<class>: n=.. p50<..us p99<..us p999<..us", percentiles
+ * are the upper bound of the bucket they fall in
+ */
+{
+  uint64_t counts[LATENCY_BUCKETS], total = 0, seen = 0;
+  const double quantiles[] = { 0.5, 0.99, 0.999 };
+  uint64_t bounds[3] = {0};
+  size_t quantile = 0;
+
+  for (size_t bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+    total += counts[bucket] = __atomic_load_n (&stats->buckets[priority][bucket], __ATOMIC_RELAXED);
+
+  for (size_t bucket = 0; bucket < LATENCY_BUCKETS && quantile < 3; ++bucket)
+    {
+      seen += counts[bucket];
+      while (quantile < 3 && total && seen >= quantiles[quantile] * total)
+        bounds[quantile++] = 1ull << bucket;
+    }
+
+  snprintf (buffer, size, "%s: n=%llu p50<%lluus p99<%lluus p999<%lluus",
+            priority_names[priority], (unsigned long long)total,
+            (unsigned long long)bounds[0], (unsigned long long)bounds[1],
+            (unsigned long long)bounds[2]);
+}
+
+/*
+ * per-socket outbox, only ever touched by whoever currently
+ * owns writes to the socket (see `fanout_pool_idle`)
+ */
+
+typedef struct outbox_frame {
+  struct outbox_frame *next;
+  uint64_t            stamp;
+  client_pkt_t        packet;
+} outbox_frame_t;
+
+typedef struct {
+  outbox_frame_t    *head[PRIORITY_CLASSES];
+  outbox_frame_t    *tail[PRIORITY_CLASSES];
+  size_t            counts[PRIORITY_CLASSES];  /* frames waiting per class */
+  outbox_frame_t    *inflight;  /* partly written, has to finish first */
+  size_t            inflight_offset;
+  size_t            queued;  /* frames, including `inflight`, read atomically */
+  memory_governor_t *governor;
+  bool              resync_owed;  /* see `outbox_resync_presence` */
+  client_pkt_t      resync_packet;
+  outbox_frame_t    resync;  /* never allocated, so it can't be refused */
+} outbox_t;
+
+outbox_t*
+outbox_create (memory_governor_t *governor)
+{
+  outbox_t *outbox = (outbox_t *)calloc (1, sizeof (outbox_t));
+  if (outbox != NULL)
+    outbox->governor = governor;
+  return outbox;
+}
+
+outbox_frame_t*
+outbox_take_head (outbox_t *outbox, priority_t priority)
+{
+  outbox_frame_t *frame = outbox->head[priority];
+  outbox->head[priority] = frame->next;
+  if (outbox->head[priority] == NULL)
+    outbox->tail[priority] = NULL;
+  --outbox->counts[priority];
+  return frame;
+}
+
+void
+outbox_free_frame (outbox_t *outbox, outbox_frame_t *frame)
+{
+  free (frame);
+  memory_release (outbox->governor, sizeof (outbox_frame_t));
+  __atomic_sub_fetch (&outbox->queued, 1, __ATOMIC_RELAXED);
+}
+
+bool
+outbox_shed_oldest (outbox_t *outbox, bool deltas)
+/*
+ * drop the oldest queued broadcast, or the oldest presence
+ * delta if `deltas`, false if there is none
+ */
+{
+  outbox_frame_t *previous = NULL, *frame = outbox->head[PRIORITY_BULK];
+
+  while (frame != NULL && (frame->packet.code == PRESENCE_DELTA) != deltas)
+    previous = frame, frame = frame->next;
+  if (frame == NULL)
+    return false;
+
+  if (previous == NULL)
+    outbox->head[PRIORITY_BULK] = frame->next;
+  else
+    previous->next = frame->next;
+  if (outbox->tail[PRIORITY_BULK] == frame)
+    outbox->tail[PRIORITY_BULK] = previous;
+  --outbox->counts[PRIORITY_BULK];
+  outbox_free_frame (outbox, frame);
+  memory_count (&outbox->governor->shed);
+  return true;
+}
+
+bool
+outbox_resync_presence (outbox_t *outbox, const client_pkt_t *delta, uint64_t stamp)
+/*
+ * a delta page that can't be queued mustn't just vanish,
+ * or the subscriber never learns it missed a version. drop
+ * every page still queued and owe it a resync as of the
+ * newest version instead. the resync lives in the outbox
+ * itself, so neither the budget nor the control cap can
+ * refuse it, and owing it twice only updates the version
+ */
+{
+  const presence_page_t *page = (const presence_page_t *)delta->message;
+
+  while (outbox_shed_oldest (outbox, true));
+  memory_count (&outbox->governor->shed);
+
+  memset (&outbox->resync_packet, 0, sizeof (client_pkt_t));
+  memcpy (outbox->resync_packet.id, delta->id, sizeof (outbox->resync_packet.id));
+  outbox->resync_packet.code = PRESENCE_RESYNC;
+  ((presence_page_t *)outbox->resync_packet.message)->version = page->version;
+  outbox->resync.stamp = stamp;
+  if (!outbox->resync_owed)
+    {
+      outbox->resync_owed = true;
+      __atomic_add_fetch (&outbox->queued, 1, __ATOMIC_RELAXED);
+    }
+  return true;
+}
+
+bool
+outbox_push (outbox_t *outbox, const client_pkt_t *packet, uint64_t stamp)
+/*
+ * false if the packet was refused: anything but control
+ * traffic once the budget less its reserve is in use, and
+ * control traffic past the whole budget or its own cap
+ */
+{
+  priority_t priority = packet_priority (packet->code);
+
+  if (priority == PRIORITY_CONTROL && outbox->counts[PRIORITY_CONTROL] >= OUTBOX_CONTROL_FRAMES)
+    {
+      memory_count (&outbox->governor->refused);
+      return false;
+    }
+
+  if (priority == PRIORITY_BULK && memory_pressure (outbox->governor) >= MEMORY_SHED)
+    /* the oldest broadcasts are stale by now, keep only the newest */
+    while (outbox->counts[PRIORITY_BULK] >= OUTBOX_LAG_FRAMES
+           && outbox_shed_oldest (outbox, false));
+
+  if (!memory_try_charge (outbox->governor, sizeof (outbox_frame_t), priority == PRIORITY_CONTROL))
+    {
+      if (packet->code == PRESENCE_DELTA)
+        return outbox_resync_presence (outbox, packet, stamp);
+      memory_count (&outbox->governor->refused);
+      return false;
+    }
+
+  outbox_frame_t *frame = (outbox_frame_t *)malloc (sizeof (outbox_frame_t));
+  if (frame == NULL)
+    {
+      memory_release (outbox->governor, sizeof (outbox_frame_t));
+      return false;
+    }
+  frame->next = NULL;
+  frame->stamp = stamp;
+  memcpy (&frame->packet, packet, sizeof (client_pkt_t));
+
+  if (outbox->tail[priority] != NULL)
+    outbox->tail[priority]->next = frame;
+  else
+    outbox->head[priority] = frame;
+  outbox->tail[priority] = frame;
+  ++outbox->counts[priority];
+  __atomic_add_fetch (&outbox->queued, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+bool
+outbox_push_inflight (outbox_t *outbox, const client_pkt_t *packet, uint64_t stamp, size_t offset)
+/*
+ * the first `offset` bytes of `packet` are already on the
+ * wire, so the rest can't be refused and has to go next.
+ * it's charged all the same, eating into the reserve
+ */
+{
+  outbox_frame_t *frame = (outbox_frame_t *)malloc (sizeof (outbox_frame_t));
+  if (frame == NULL)
+    return false;
+  frame->next = NULL;
+  frame->stamp = stamp;
+  memcpy (&frame->packet, packet, sizeof (client_pkt_t));
+  memory_charge (outbox->governor, sizeof (outbox_frame_t));
+
+  outbox->inflight = frame;
+  outbox->inflight_offset = offset;
+  __atomic_add_fetch (&outbox->queued, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+outbox_frame_t*
+outbox_peek (outbox_t *outbox)
+/*
+ * the frame to write next: the partly written one if
+ * any, then an owed resync, otherwise the head of the
+ * most urgent class
+ */
+{
+  if (outbox->inflight != NULL)
+    return outbox->inflight;
+  if (outbox->resync_owed)
+    /* copied only now, the previous resync may just have been on the wire */
+    {
+      memcpy (&outbox->resync.packet, &outbox->resync_packet, sizeof (client_pkt_t));
+      outbox->resync_owed = false;
+      outbox->inflight = &outbox->resync;
+      outbox->inflight_offset = 0;
+      return outbox->inflight;
+    }
+  for (size_t priority = 0; priority < PRIORITY_CLASSES; ++priority)
+    if (outbox->head[priority] != NULL)
+      {
+        outbox->inflight = outbox_take_head (outbox, (priority_t)priority);
+        outbox->inflight_offset = 0;
+        return outbox->inflight;
+      }
+  return NULL;
+}
+
+void
+outbox_pop (outbox_t *outbox)
+/*
+ * the frame returned by `outbox_peek` was fully written
+ */
+{
+  if (outbox->inflight == &outbox->resync)
+    __atomic_sub_fetch (&outbox->queued, 1, __ATOMIC_RELAXED);
+  else
+    outbox_free_frame (outbox, outbox->inflight);
+  outbox->inflight = NULL;
+  outbox->inflight_offset = 0;
+}
+
+void
+outbox_discard (outbox_t *outbox)
+/*
+ * drop everything still waiting, but not a frame that is
+ * already partly on the wire
+ */
+{
+  for (size_t priority = 0; priority < PRIORITY_CLASSES; ++priority)
+    while (outbox->head[priority] != NULL)
+      outbox_free_frame (outbox, outbox_take_head (outbox, (priority_t)priority));
+  if (outbox->resync_owed)
+    {
+      outbox->resync_owed = false;
+      __atomic_sub_fetch (&outbox->queued, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void
+outbox_clear (outbox_t *outbox)
+{
+  while (outbox_peek (outbox) != NULL)
+    outbox_pop (outbox);
+}
+
+#endif  /* __SCHEDULER_H */
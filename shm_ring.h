@@ -0,0 +1,216 @@
+#ifndef __SHM_RING_H
+#define __SHM_RING_H
+
+/*
+ * Shared-memory transport for clients on the same host.
+ * A local client asks for it in its CLIENT_IDENT message,
+ * and the server answers the CONNECT_ACK with a memfd and
+ * two eventfds attached over the AF_UNIX socket.
+ *
+ * The region holds one single-producer single-consumer
+ * ring per direction, carrying whole `client_pkt_t`s. A
+ * consumer about to sleep raises `waiting` and the producer
+ * only rings the eventfd doorbell when it sees it, so a busy
+ * pair of peers exchanges frames without any syscalls.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "pkt_struct.h"
+
+#define SHM_RING_SLOTS        (256)  /* power of two */
+#define SHM_REGION_MAGIC      (0x43485331)
+#define SHM_TRANSPORT_REQUEST ("transport:shm")  /* CLIENT_IDENT message */
+#define SHM_TRANSPORT_FDS     (3)  /* memfd, server doorbell, client doorbell */
+
+typedef struct {
+  uint32_t      head __attribute__ ((aligned (64)));  /* advanced by consumer */
+  uint32_t      tail __attribute__ ((aligned (64)));  /* advanced by producer */
+  uint32_t      waiting __attribute__ ((aligned (64)));  /* consumer is asleep */
+  client_pkt_t  slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+typedef struct {
+  uint32_t    magic;
+  uint32_t    closed;  /* either side hung up */
+  shm_ring_t  to_server;
+  shm_ring_t  to_client;
+} shm_region_t;
+
+typedef struct {
+  shm_region_t  *region;
+  int           memfd;
+  int           server_doorbell;  /* kicked when `to_server` gets data */
+  int           client_doorbell;  /* kicked when `to_client` gets data */
+} shm_transport_t;
+
+bool
+shm_ring_push (shm_ring_t *ring, int doorbell, const client_pkt_t *packet)
+/*
+ * returns false when the ring is full, which the
+ * caller treats the same as a socket's EWOULDBLOCK
+ */
+{
+  uint32_t tail = ring->tail;
+  if (tail - __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) >= SHM_RING_SLOTS)
+    return false;
+  memcpy (&ring->slots[tail % SHM_RING_SLOTS], packet, sizeof (client_pkt_t));
+  __atomic_store_n (&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+  /* pairs with the fence in `shm_ring_sleep` */
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&ring->waiting, __ATOMIC_RELAXED))
+    {
+      uint64_t one = 1;
+      write (doorbell, &one, sizeof (uint64_t));
+    }
+  return true;
+}
+
+bool
+shm_ring_pop (shm_ring_t *ring, client_pkt_t *packet)
+{
+  uint32_t head = ring->head;
+  if (head == __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE))
+    return false;
+  memcpy (packet, &ring->slots[head % SHM_RING_SLOTS], sizeof (client_pkt_t));
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool
+shm_ring_sleep (shm_ring_t *ring)
+/*
+ * announce the consumer is about to block on its doorbell,
+ * returns false if data raced in and it shouldn't block.
+ * call `shm_ring_wake` once woken up
+ */
+{
+  __atomic_store_n (&ring->waiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (ring->head != __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE))
+    {
+      __atomic_store_n (&ring->waiting, 0, __ATOMIC_RELAXED);
+      return false;
+    }
+  return true;
+}
+
+void
+shm_ring_wake (shm_ring_t *ring, int doorbell)
+{
+  uint64_t count;
+  __atomic_store_n (&ring->waiting, 0, __ATOMIC_RELAXED);
+  read (doorbell, &count, sizeof (uint64_t));  /* doorbells are non-blocking */
+}
+
+bool
+shm_transport_create (shm_transport_t *transport)
+/*
+ * server side, map a fresh region and its doorbells
+ */
+{
+  memset (transport, 0, sizeof (shm_transport_t));
+  transport->server_doorbell = transport->client_doorbell = -1;
+
+  if ( (transport->memfd = memfd_create ("confserver-shm", MFD_CLOEXEC)) < 0)
+    return false;
+
+  if (ftruncate (transport->memfd, sizeof (shm_region_t)) < 0)
+    goto on_error;
+
+  transport->region = (shm_region_t *)mmap (
+      NULL, sizeof (shm_region_t), PROT_READ | PROT_WRITE,
+      MAP_SHARED, transport->memfd, 0);
+  if (transport->region == MAP_FAILED)
+    {
+      transport->region = NULL;
+      goto on_error;
+    }
+  transport->region->magic = SHM_REGION_MAGIC;
+
+  transport->server_doorbell = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  transport->client_doorbell = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (transport->server_doorbell < 0 || transport->client_doorbell < 0)
+    goto on_error;
+
+  return true;
+
+on_error:
+  if (transport->region != NULL)
+    munmap (transport->region, sizeof (shm_region_t));
+  if (transport->server_doorbell > -1)
+    close (transport->server_doorbell);
+  if (transport->client_doorbell > -1)
+    close (transport->client_doorbell);
+  close (transport->memfd);
+  return false;
+}
+
+bool
+shm_transport_attach (shm_transport_t *transport, int fds[SHM_TRANSPORT_FDS])
+/*
+ * client side, map the region the server handed over
+ */
+{
+  transport->memfd = fds[0];
+  transport->server_doorbell = fds[1];
+  transport->client_doorbell = fds[2];
+  transport->region = (shm_region_t *)mmap (
+      NULL, sizeof (shm_region_t), PROT_READ | PROT_WRITE,
+      MAP_SHARED, transport->memfd, 0);
+  if (transport->region == MAP_FAILED)
+    {
+      transport->region = NULL;
+      return false;
+    }
+  return transport->region->magic == SHM_REGION_MAGIC;
+}
+
+bool
+shm_transport_grant (shm_transport_t *transport, sockfd_t sockfd, const client_pkt_t *packet)
+/*
+ * send `packet` over the socket with the region's
+ * descriptors attached
+ */
+{
+  int fds[SHM_TRANSPORT_FDS] = {
+    transport->memfd, transport->server_doorbell, transport->client_doorbell
+    };
+  char control[CMSG_SPACE (sizeof (fds))] = {0};
+  struct iovec iov = {
+    .iov_base = (void *)packet,
+    .iov_len  = sizeof (client_pkt_t)
+    };
+  struct msghdr msg = {0};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+  return sendmsg (sockfd, &msg, MSG_NOSIGNAL) == sizeof (client_pkt_t);
+}
+
+void
+shm_transport_free (shm_transport_t *transport)
+{
+  __atomic_store_n (&transport->region->closed, 1, __ATOMIC_RELEASE);
+  munmap (transport->region, sizeof (shm_region_t));
+  close (transport->memfd);
+  close (transport->server_doorbell);
+  close (transport->client_doorbell);
+}
+
+#endif  /* __SHM_RING_H */